@@ -0,0 +1,50 @@
+# flatt_generate(<target>
+#   PROJECT <project.lua>
+#   [OUTPUTS <files>...]
+#   [ARGS <arguments>...]
+#   [DEPENDS <files>...]
+#   [WORKING_DIRECTORY <dir>]
+# )
+#
+# Runs a flatt project as a custom command. flatt writes a depfile listing
+# every file the run read (script, required modules, schemas and their
+# includes, templates, ...), so the command only re-runs when one of them
+# changes. OUTPUTS lists the generated files other targets consume; the
+# complete list of what the run wrote ends up in ${target}.outputs in the
+# current binary directory.
+#
+# The flatt executable is taken from FLATT_EXECUTABLE, else looked up in PATH.
+
+function(flatt_generate target)
+  cmake_parse_arguments(PARSE_ARGV 1 FLATT "" "PROJECT;WORKING_DIRECTORY" "OUTPUTS;ARGS;DEPENDS")
+
+  if(NOT FLATT_PROJECT)
+    message(FATAL_ERROR "flatt_generate(${target}): PROJECT is required")
+  endif()
+
+  if(NOT FLATT_EXECUTABLE)
+    find_program(FLATT_EXECUTABLE NAMES flatt REQUIRED)
+  endif()
+
+  if(NOT FLATT_WORKING_DIRECTORY)
+    set(FLATT_WORKING_DIRECTORY "${CMAKE_CURRENT_BINARY_DIR}")
+  endif()
+
+  cmake_path(ABSOLUTE_PATH FLATT_PROJECT BASE_DIRECTORY "${CMAKE_CURRENT_SOURCE_DIR}")
+
+  set(manifest "${CMAKE_CURRENT_BINARY_DIR}/${target}.outputs")
+  set(depfile "${CMAKE_CURRENT_BINARY_DIR}/${target}.d")
+
+  # the manifest comes first: it is the depfile's target
+  add_custom_command(
+    OUTPUT "${manifest}" ${FLATT_OUTPUTS}
+    COMMAND "${FLATT_EXECUTABLE}" --depfile "${depfile}" --outputs "${manifest}" "${FLATT_PROJECT}" ${FLATT_ARGS}
+    DEPFILE "${depfile}"
+    DEPENDS "${FLATT_PROJECT}" ${FLATT_DEPENDS}
+    WORKING_DIRECTORY "${FLATT_WORKING_DIRECTORY}"
+    COMMENT "Generating ${target} with flatt"
+    VERBATIM
+  )
+
+  add_custom_target(${target} DEPENDS "${manifest}" ${FLATT_OUTPUTS})
+endfunction()
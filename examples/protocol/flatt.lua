@@ -1,7 +1,6 @@
 -- imports
 
 local array = require("array")
-local lunajson = require("lunajson")
 local inspect = require("inspect")
 
 -- cli options
@@ -30,7 +29,7 @@ end
 
 -- decode type information into lua objects
 
-local reflection = lunajson.decode(reflection)
+local reflection = json.decode(reflection)
 
 -- generate a version string for the given schema
 
@@ -64,7 +63,7 @@ local files = flatt.dir.list_files("./template")
 for i,file in pairs(files) do
   local source = './template/' .. file
   local destination = "./generated/" .. file
-  local data = lunajson.encode({
+  local data = json.encode({
     version = version,
     packets = packets,
     enums = enums,
@@ -1,7 +1,3 @@
--- imports
-
-local json = require("lunajson")
-
 -- compile fbs
 local generated = fb.compile({
   "--gen-all",
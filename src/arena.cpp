@@ -0,0 +1,116 @@
+#include <algorithm>
+#include <cstdlib>
+
+#include "./arena.hpp"
+
+using namespace std;
+
+namespace {
+
+  thread_local arena::monotonic *active = nullptr;
+
+  size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+  }
+
+} // namespace
+
+arena::monotonic::monotonic(size_t block_size) : _block_size(block_size) {}
+
+arena::monotonic::~monotonic() {
+  for (auto [block, size] : _blocks) {
+    ::operator delete(block);
+  }
+}
+
+void *arena::monotonic::allocate(size_t size, size_t alignment) {
+  // every block starts on a class boundary, so a freed one can serve any
+  // request of its class
+  alignment = max(alignment, granularity);
+
+  // small sizes round up to their class, so freed ones fit the next request
+  if (alignment == granularity && size > 0 && size <= granularity * classes) {
+    size = align_up(size, granularity);
+    auto &list = _free[size / granularity - 1];
+    if (list != nullptr) {
+      auto result = list;
+      list = *static_cast<void **>(list);
+      _used += size;
+      return result;
+    }
+  }
+
+  auto address = reinterpret_cast<uintptr_t>(_current);
+  auto padding = align_up(address, alignment) - address;
+
+  if (_current == nullptr || padding + size > _left) {
+    // blocks double up to 16 MiB so large documents take few of them
+    auto capacity = max(_block_size, size + alignment);
+    _block_size = min<size_t>(_block_size * 2, 16 * 1024 * 1024);
+
+    auto block = static_cast<byte *>(::operator new(capacity));
+    _blocks.emplace_back(block, capacity);
+    _current = block;
+    _left = capacity;
+    _reserved += capacity;
+
+    address = reinterpret_cast<uintptr_t>(_current);
+    padding = align_up(address, alignment) - address;
+  }
+
+  auto result = _current + padding;
+  _current += padding + size;
+  _left -= padding + size;
+  _used += size;
+  return result;
+}
+
+void arena::monotonic::deallocate(void *p, size_t size, size_t alignment) {
+  if (alignment > granularity || size == 0 || size > granularity * classes || !owns(p)) {
+    return;
+  }
+
+  size = align_up(size, granularity);
+  auto &list = _free[size / granularity - 1];
+  *static_cast<void **>(p) = list;
+  list = p;
+  _used -= size;
+}
+
+bool arena::monotonic::owns(const void *p) const {
+  auto address = static_cast<const byte *>(p);
+  // newest first, that's where most frees land
+  for (auto block = _blocks.rbegin(); block != _blocks.rend(); block++) {
+    if (address >= block->first && address < block->first + block->second) {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t arena::monotonic::used() const {
+  return _used;
+}
+
+size_t arena::monotonic::reserved() const {
+  return _reserved;
+}
+
+arena::scope::scope(monotonic &memory) : _previous(active) {
+  active = &memory;
+}
+
+arena::scope::~scope() {
+  active = _previous;
+}
+
+arena::monotonic *arena::current() {
+  return active;
+}
+
+std::string arena::dump(const json &document, int indent) {
+  auto result = std::string{};
+  auto output = nlohmann::detail::output_adapter<char, std::string>(result);
+  nlohmann::detail::serializer<json>(output, ' ').dump(document, indent >= 0, false, static_cast<unsigned int>(max(indent, 0)));
+  return result;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+namespace arena {
+
+  // Hands out memory from growing blocks and frees all of it at once when
+  // destroyed. Freed small allocations are kept for the next ones of their
+  // size, larger ones stay where they are until then.
+  class monotonic {
+  public:
+    explicit monotonic(size_t block_size = 64 * 1024);
+    monotonic(const monotonic &) = delete;
+    ~monotonic();
+
+    monotonic &operator=(const monotonic &) = delete;
+
+    void *allocate(size_t size, size_t alignment);
+    // Ignores memory of other arenas.
+    void deallocate(void *p, size_t size, size_t alignment);
+
+    bool owns(const void *p) const;
+
+    // Constructs a `T` that is never destroyed, for values (like `json`
+    // documents) whose memory all comes from this arena anyway: skipping the
+    // destructor skips walking them just to free nothing.
+    template <typename T, typename... Args>
+    T &make(Args &&...args) {
+      return *new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // Bytes currently handed out, and bytes taken from the heap for them.
+    size_t used() const;
+    size_t reserved() const;
+
+  private:
+    static constexpr size_t granularity = 16;
+    static constexpr size_t classes = 16;
+
+    std::vector<std::pair<std::byte *, size_t>> _blocks;
+    void *_free[classes] = {};
+    std::byte *_current = nullptr;
+    size_t _left = 0;
+    size_t _block_size;
+    size_t _used = 0;
+    size_t _reserved = 0;
+  };
+
+  // Makes default constructed allocators on this thread use `memory` while
+  // the scope lives, which is how nlohmann::basic_json gets its allocators.
+  class scope {
+  public:
+    explicit scope(monotonic &memory);
+    scope(const scope &) = delete;
+    ~scope();
+
+    scope &operator=(const scope &) = delete;
+
+  private:
+    monotonic *_previous;
+  };
+
+  // The arena of the innermost scope on this thread, if any.
+  monotonic *current();
+
+  // Allocates from the arena it was made with, or the current scope's one
+  // when default constructed. Containers keep their allocator, so their
+  // memory goes back to its own arena wherever they die; basic_json default
+  // constructs one to free its nodes, and the arena ignores what isn't its
+  // own. Allocating without an arena throws std::bad_alloc.
+  template <typename T>
+  struct allocator {
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    allocator() noexcept : memory(current()) {}
+
+    explicit allocator(monotonic &arena) noexcept : memory(&arena) {}
+
+    template <typename U>
+    allocator(const allocator<U> &other) noexcept : memory(other.memory) {}
+
+    T *allocate(size_t count) {
+      if (memory == nullptr) {
+        throw std::bad_alloc();
+      }
+      return static_cast<T *>(memory->allocate(count * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *p, size_t count) noexcept {
+      if (memory != nullptr) {
+        memory->deallocate(p, count * sizeof(T), alignof(T));
+      }
+    }
+
+    template <typename U>
+    bool operator==(const allocator<U> &other) const noexcept {
+      return memory == other.memory;
+    }
+
+    monotonic *memory;
+  };
+
+  using string = std::basic_string<char, std::char_traits<char>, allocator<char>>;
+
+  // For large transient documents (e.g. the reflection DOM): every node,
+  // string and object entry lands in the arena of the scope it was built in,
+  // which has to outlive the document.
+  using json = nlohmann::basic_json<std::map, std::vector, string, bool, std::int64_t, std::uint64_t, double, allocator>;
+
+  // Like `document.dump(indent)`, straight into a heap string that outlives
+  // the arena.
+  std::string dump(const json &document, int indent = -1);
+
+} // namespace arena
@@ -0,0 +1,80 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#include "./async.hpp"
+#include "./parallel.hpp"
+
+using namespace std;
+
+namespace {
+
+  struct signal {
+    mutex lock;
+    condition_variable changed;
+    size_t generation = 0;
+  };
+
+  signal &completions() {
+    static signal s;
+    return s;
+  }
+
+} // namespace
+
+void async::notify() {
+  auto &s = completions();
+  {
+    auto lock = lock_guard(s.lock);
+    s.generation++;
+  }
+  s.changed.notify_all();
+}
+
+size_t async::wait_any(const vector<function<bool()>> &done) {
+  auto &s = completions();
+  while (true) {
+    auto seen = size_t{};
+    {
+      auto lock = lock_guard(s.lock);
+      seen = s.generation;
+    }
+
+    // anything completing after `seen` was read bumps the generation, so the
+    // wait below can't miss it
+    for (size_t i = 0; i < done.size(); i++) {
+      if (done[i]()) {
+        return i;
+      }
+    }
+
+    auto lock = unique_lock(s.lock);
+    s.changed.wait(lock, [&]() {
+      return s.generation != seen;
+    });
+  }
+}
+
+bool async::operation::done() const {
+  return _future.wait_for(chrono::seconds(0)) == future_status::ready;
+}
+
+const vector<marshal::value> &async::operation::wait() const {
+  return _future.get();
+}
+
+shared_ptr<async::operation> async::start(function<vector<marshal::value>()> work) {
+  // operations mostly wait on files and processes, so keep a few in flight
+  // even on small machines
+  static parallel::pool operations(max<size_t>(parallel::concurrency(), 4));
+
+  auto task = make_shared<packaged_task<vector<marshal::value>()>>(move(work));
+  auto handle = make_shared<operation>(task->get_future().share());
+  operations.submit([task]() {
+    (*task)();
+    notify();
+  });
+
+  return handle;
+}
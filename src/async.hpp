@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "./marshal.hpp"
+
+namespace async {
+
+  // Wakes `wait_any` callers; called whenever work they may be waiting on
+  // (operations, process jobs) completes.
+  void notify();
+
+  // Blocks until one of the `done` checks (at least one) returns true and
+  // returns its index. Checks re-run after every `notify` rather than polling.
+  size_t wait_any(const std::vector<std::function<bool()>> &done);
+
+  // Work running on the shared pool whose results (the values a Lua binding
+  // would have returned) a script awaits.
+  class operation {
+  public:
+    explicit operation(std::shared_future<std::vector<marshal::value>> future)
+      : _future(std::move(future)) {
+    }
+
+    bool done() const;
+    const std::vector<marshal::value> &wait() const;
+
+  private:
+    std::shared_future<std::vector<marshal::value>> _future;
+  };
+
+  // Runs `work` on a shared pool (one thread per core, at least 4), notifying
+  // when it's done.
+  std::shared_ptr<operation> start(std::function<std::vector<marshal::value>()> work);
+
+} // namespace async
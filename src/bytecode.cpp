@@ -0,0 +1,167 @@
+#ifdef _WIN32
+  #include <process.h>
+#else
+  #include <unistd.h>
+#endif
+
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#include <spdlog/spdlog.h>
+
+#include "./bytecode.hpp"
+#include "./hash.hpp"
+#include "./io.hpp"
+
+using namespace std;
+using namespace std::filesystem;
+
+namespace {
+
+  // bytecode is only portable between identical runtimes and pointer sizes
+  constexpr auto runtime =
+#ifdef LUAJIT_VERSION
+    LUAJIT_VERSION
+#else
+    LUA_RELEASE
+#endif
+    ;
+
+  // parallel_map workers load modules too
+  struct loaded_sources {
+    mutex lock;
+    map<string, string> digests;
+  };
+
+  loaded_sources &loaded() {
+    static auto instance = loaded_sources{};
+    return instance;
+  }
+
+  int append_chunk(lua_State *, const void *data, size_t size, void *buffer) {
+    static_cast<string *>(buffer)->append(static_cast<const char *>(data), size);
+    return 0;
+  }
+
+  bool read_cached(const path &file, string &data) {
+    ifstream ifs(file, ios::binary);
+    if (!ifs.is_open()) {
+      return false;
+    }
+    auto buffer = stringstream{};
+    buffer << ifs.rdbuf();
+    data = buffer.str();
+    return true;
+  }
+
+  void write_cached(const path &file, const string &data) {
+    error_code ec;
+    create_directories(file.parent_path(), ec);
+
+#ifdef _WIN32
+    auto pid = _getpid();
+#else
+    auto pid = getpid();
+#endif
+    // parallel_map workers of this process may write the same chunk at once
+    static auto writes = atomic<unsigned>{ 0 };
+    auto temp = file;
+    temp += "." + to_string(pid) + "." + to_string(writes++) + ".tmp";
+    {
+      ofstream ofs(temp, ios::binary | ios::trunc);
+      ofs.write(data.data(), data.size());
+      if (!ofs.good()) {
+        remove(temp, ec);
+        return;
+      }
+    }
+
+    rename(temp, file, ec);
+    if (ec) {
+      remove(temp, ec);
+    }
+  }
+
+} // namespace
+
+int bytecode::load_file(lua_State *L, const path &file, const path &cache_dir) {
+  auto chunkname = "@" + file.string();
+
+  auto mapped = io::map_file(file);
+  if (!mapped.has_value()) {
+    lua_pushfstring(L, "cannot open %s", file.string().c_str());
+    return LUA_ERRFILE;
+  }
+
+  auto digest = hashes::xxh128(mapped->view());
+  {
+    auto name = file.lexically_normal().lexically_proximate(current_path()).generic_string();
+    auto &l = loaded();
+    auto lock = lock_guard(l.lock);
+    l.digests[name] = digest;
+  }
+
+  // like luaL_loadfile, skip a '#!' first line but keep the line numbers
+  auto source = mapped->view();
+  if (!source.empty() && source.front() == '#') {
+    auto newline = source.find('\n');
+    source = newline == string_view::npos ? string_view() : source.substr(newline);
+  }
+
+  auto key = string(runtime);
+  key += '\0';
+  key += to_string(sizeof(void *));
+  key += '\0';
+  key += chunkname;
+  auto cached = cache_dir / (hashes::xxh128(key) + ".luac");
+
+  // an entry is the source's digest on the first line, then the bytecode;
+  // an edit overwrites the entry instead of adding one
+  auto header = digest + '\n';
+  auto data = string{};
+  if (read_cached(cached, data) && data.starts_with(header)) {
+    auto chunk = string_view(data).substr(header.size());
+    if (luaL_loadbufferx(L, chunk.data(), chunk.size(), chunkname.c_str(), "b") == LUA_OK) {
+      return LUA_OK;
+    }
+    spdlog::debug("Ignoring cached bytecode for {}: {}", file.string(), lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
+
+  auto status = luaL_loadbufferx(L, source.data(), source.size(), chunkname.c_str(), nullptr);
+  if (status != LUA_OK) {
+    return status;
+  }
+
+  data = dump(L);
+  if (!data.empty()) {
+    write_cached(cached, header + data);
+  }
+
+  return LUA_OK;
+}
+
+map<string, string> bytecode::sources() {
+  auto &l = loaded();
+  auto lock = lock_guard(l.lock);
+  return l.digests;
+}
+
+void bytecode::reset() {
+  auto &l = loaded();
+  auto lock = lock_guard(l.lock);
+  l.digests.clear();
+}
+
+string bytecode::dump(lua_State *L) {
+  auto data = string{};
+#if LUA_VERSION_NUM >= 503
+  auto status = lua_dump(L, append_chunk, &data, 0);
+#else
+  auto status = lua_dump(L, append_chunk, &data);
+#endif
+  return status == 0 ? data : string();
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <filesystem>
+#include <map>
+#include <string>
+
+#include <lua.hpp>
+
+namespace bytecode {
+
+  // Pushes the chunk in `file` like luaL_loadfile and returns the load
+  // status (an error message is pushed instead on failure). The compiled
+  // chunk is kept in `cache_dir`, one entry per file name and Lua runtime,
+  // along with the hash of the source it was compiled from, and is loaded
+  // from there on later runs while the source is unchanged. Bytecode the
+  // runtime refuses (e.g. written by another Lua version) is recompiled.
+  int load_file(lua_State *L, const std::filesystem::path &file, const std::filesystem::path &cache_dir);
+
+  // The xxh128 of every source `load_file` read since the last `reset`, by
+  // file (relative to the working directory when below it).
+  std::map<std::string, std::string> sources();
+  void reset();
+
+  // The bytecode of the function on top of the stack, with debug info. Empty
+  // when it can't be dumped (C functions).
+  std::string dump(lua_State *L);
+
+} // namespace bytecode
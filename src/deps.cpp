@@ -0,0 +1,142 @@
+#include <map>
+#include <mutex>
+#include <set>
+
+#include "./deps.hpp"
+#include "./output.hpp"
+
+using namespace std;
+using namespace std::filesystem;
+
+namespace {
+
+  struct state {
+    mutex lock;
+    map<string, optional<hash_cache::file_stat>> inputs;
+    set<string> outputs;
+  };
+
+  state &tracked() {
+    static state instance;
+    return instance;
+  }
+
+  string normalize(const path &p) {
+    error_code ec;
+    auto full = absolute(p, ec);
+    return (ec ? p : full).lexically_normal().generic_string();
+  }
+
+  // make and ninja both read '\ ', '\#' and '$$' as literal characters
+  string escape(string_view name) {
+    auto escaped = string{};
+    for (auto c : name) {
+      if (c == ' ' || c == '#') {
+        escaped += '\\';
+      } else if (c == '$') {
+        escaped += '$';
+      }
+      escaped += c;
+    }
+    return escaped;
+  }
+
+} // namespace
+
+void deps::read(const path &p) {
+  auto name = normalize(p);
+  auto &t = tracked();
+  {
+    auto lock = lock_guard(t.lock);
+    if (t.inputs.contains(name)) {
+      return;
+    }
+  }
+
+  // so watch mode notices changes made while the run was still going
+  auto stat = hash_cache::stat(name);
+  auto lock = lock_guard(t.lock);
+  t.inputs.emplace(move(name), stat);
+}
+
+void deps::wrote(const path &p) {
+  auto name = normalize(p);
+  auto &t = tracked();
+  auto lock = lock_guard(t.lock);
+  t.outputs.insert(move(name));
+}
+
+void deps::forget(const path &p) {
+  auto name = normalize(p);
+  auto &t = tracked();
+  auto lock = lock_guard(t.lock);
+  t.inputs.erase(name);
+}
+
+vector<string> deps::inputs() {
+  auto &t = tracked();
+  auto lock = lock_guard(t.lock);
+  auto names = vector<string>{};
+  for (auto &[name, stat] : t.inputs) {
+    names.push_back(name);
+  }
+  return names;
+}
+
+vector<optional<hash_cache::file_stat>> deps::seen() {
+  auto &t = tracked();
+  auto lock = lock_guard(t.lock);
+  auto stats = vector<optional<hash_cache::file_stat>>{};
+  for (auto &[name, stat] : t.inputs) {
+    // the run rewriting what it read isn't a change to run again for
+    stats.push_back(t.outputs.contains(name) ? hash_cache::stat(name) : stat);
+  }
+  return stats;
+}
+
+vector<string> deps::outputs() {
+  auto &t = tracked();
+  auto lock = lock_guard(t.lock);
+  return vector<string>(t.outputs.begin(), t.outputs.end());
+}
+
+void deps::reset() {
+  auto &t = tracked();
+  auto lock = lock_guard(t.lock);
+  t.inputs.clear();
+  t.outputs.clear();
+}
+
+bool deps::write_depfile(const path &file, const vector<string> &targets) {
+  auto written = outputs();
+  auto produced = set<string>(written.begin(), written.end());
+
+  auto rule = string{};
+  for (auto &target : targets) {
+    rule += escape(normalize(target));
+    rule += ' ';
+  }
+  if (!rule.empty()) {
+    rule.pop_back();
+  }
+  rule += ':';
+
+  for (auto &input : inputs()) {
+    if (produced.count(input) == 0) {
+      rule += " \\\n  ";
+      rule += escape(input);
+    }
+  }
+  rule += '\n';
+
+  return output::write(file, rule);
+}
+
+bool deps::write_manifest(const path &file) {
+  auto manifest = string{};
+  for (auto &written : outputs()) {
+    manifest += written;
+    manifest += '\n';
+  }
+  return output::write(file, manifest);
+}
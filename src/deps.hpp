@@ -0,0 +1,35 @@
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "./hash_cache.hpp"
+
+namespace deps {
+
+  // Records files the current run read or wrote (absolute, '/' separated).
+  void read(const std::filesystem::path &p);
+  void wrote(const std::filesystem::path &p);
+  // Drops a scratch file that was read but isn't an input of the run.
+  void forget(const std::filesystem::path &p);
+
+  std::vector<std::string> inputs();
+  std::vector<std::string> outputs();
+
+  // How each of `inputs()` looked when the run first read it (or now, for
+  // the ones it also wrote).
+  std::vector<std::optional<hash_cache::file_stat>> seen();
+
+  void reset();
+
+  // Make style rule "targets: inputs" for build tools (ninja/make DEPFILE).
+  // Inputs that the run also wrote are left out so a generator reading back
+  // its own output doesn't depend on itself.
+  bool write_depfile(const std::filesystem::path &file, const std::vector<std::string> &targets);
+
+  // The files the run wrote, one per line.
+  bool write_manifest(const std::filesystem::path &file);
+
+} // namespace deps
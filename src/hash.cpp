@@ -1,24 +1,167 @@
+#include <array>
+#include <cstring>
+#include <vector>
+
 #include <cryptopp/sha.h>
-#include <cryptopp/hex.h>
+#include <xxhash.h>
 
 #include "./hash.hpp"
+#include "./parallel.hpp"
 
 using namespace std;
 using namespace CryptoPP;
 
-string hashes::sha1(const string& data) {
-  using byte = CryptoPP::byte;
+template <size_t N>
+static string hex_encode(const array<uint8_t, N> &digest) {
+  constexpr auto digits = "0123456789ABCDEF";
+
+  char encoded[N * 2];
+  for (size_t i = 0; i < N; i++) {
+    encoded[i * 2] = digits[digest[i] >> 4];
+    encoded[i * 2 + 1] = digits[digest[i] & 0x0F];
+  }
 
-  byte digest[SHA1::DIGESTSIZE];
+  return string(encoded, sizeof(encoded));
+}
 
-  SHA1().CalculateDigest(digest, (const uint8_t*)data.data(), data.size());
+static array<uint8_t, 8> canonical(XXH64_hash_t hash) {
+  XXH64_canonical_t canonical;
+  XXH64_canonicalFromHash(&canonical, hash);
+
+  auto bytes = array<uint8_t, 8>{};
+  memcpy(bytes.data(), canonical.digest, bytes.size());
+  return bytes;
+}
 
-  string encoded;
+static array<uint8_t, 16> canonical(XXH128_hash_t hash) {
+  XXH128_canonical_t canonical;
+  XXH128_canonicalFromHash(&canonical, hash);
+
+  auto bytes = array<uint8_t, 16>{};
+  memcpy(bytes.data(), canonical.digest, bytes.size());
+  return bytes;
+}
+
+optional<hashes::algorithm> hashes::parse_algorithm(string_view name) {
+  if (name == "sha1") {
+    return algorithm::sha1;
+  } else if (name == "xxh3") {
+    return algorithm::xxh3;
+  } else if (name == "xxh128") {
+    return algorithm::xxh128;
+  }
+  return {};
+}
+
+string_view hashes::algorithm_name(algorithm algo) {
+  switch (algo) {
+  case algorithm::xxh3:
+    return "xxh3";
+  case algorithm::xxh128:
+    return "xxh128";
+  default:
+    return "sha1";
+  }
+}
+
+string hashes::sha1(string_view data) {
+  auto digest = array<uint8_t, SHA1::DIGESTSIZE>{};
+
+  SHA1().CalculateDigest(digest.data(), (const uint8_t*)data.data(), data.size());
+
+  return hex_encode(digest);
+}
+
+string hashes::xxh3(string_view data) {
+  return hex_encode(canonical(XXH3_64bits(data.data(), data.size())));
+}
 
-  HexEncoder encoder;
-  encoder.Attach(new StringSink(encoded));
-  encoder.Put(digest, sizeof(digest));
-  encoder.MessageEnd();
+string hashes::xxh128(string_view data) {
+  return hex_encode(canonical(XXH3_128bits(data.data(), data.size())));
+}
+
+string hashes::digest(algorithm algo, string_view data) {
+  switch (algo) {
+  case algorithm::xxh3:
+    return xxh3(data);
+  case algorithm::xxh128:
+    return xxh128(data);
+  default:
+    return sha1(data);
+  }
+}
+
+string hashes::tree_digest(algorithm algo, string_view data) {
+  if (algo == algorithm::sha1 || data.size() <= tree_chunk_size) {
+    return digest(algo, data);
+  }
+
+  auto count = (data.size() + tree_chunk_size - 1) / tree_chunk_size;
+  auto leaves = vector<XXH128_canonical_t>(count);
+
+  parallel::for_each(count, [&](size_t index) {
+    auto chunk = data.substr(index * tree_chunk_size, tree_chunk_size);
+    XXH128_canonicalFromHash(&leaves[index], XXH3_128bits(chunk.data(), chunk.size()));
+  });
+
+  XXH64_canonical_t length;
+  XXH64_canonicalFromHash(&length, data.size());
+
+  auto root = stream(algo);
+  root.update(string_view((const char*)leaves.data(), leaves.size() * sizeof(XXH128_canonical_t)));
+  root.update(string_view((const char*)length.digest, sizeof(length.digest)));
+  return root.digest();
+}
+
+struct hashes::stream::state {
+  SHA1 sha1;
+  XXH3_state_t* xxh = nullptr;
+
+  ~state() {
+    if (xxh != nullptr) {
+      XXH3_freeState(xxh);
+    }
+  }
+};
+
+hashes::stream::stream(algorithm algo)
+  : _algorithm(algo)
+  , _state(make_unique<state>()) {
+  if (algo == algorithm::xxh3) {
+    _state->xxh = XXH3_createState();
+    XXH3_64bits_reset(_state->xxh);
+  } else if (algo == algorithm::xxh128) {
+    _state->xxh = XXH3_createState();
+    XXH3_128bits_reset(_state->xxh);
+  }
+}
+
+hashes::stream::~stream() = default;
+
+void hashes::stream::update(string_view data) {
+  switch (_algorithm) {
+  case algorithm::xxh3:
+    XXH3_64bits_update(_state->xxh, data.data(), data.size());
+    break;
+  case algorithm::xxh128:
+    XXH3_128bits_update(_state->xxh, data.data(), data.size());
+    break;
+  default:
+    _state->sha1.Update((const uint8_t*)data.data(), data.size());
+    break;
+  }
+}
 
-  return encoded;
+string hashes::stream::digest() {
+  switch (_algorithm) {
+  case algorithm::xxh3:
+    return hex_encode(canonical(XXH3_64bits_digest(_state->xxh)));
+  case algorithm::xxh128:
+    return hex_encode(canonical(XXH3_128bits_digest(_state->xxh)));
+  default: {
+    auto digest = array<uint8_t, SHA1::DIGESTSIZE>{};
+    _state->sha1.Final(digest.data());
+    return hex_encode(digest);
+  }
+  }
 }
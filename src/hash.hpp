@@ -1,9 +1,46 @@
 #pragma once
 
+#include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
 
 namespace hashes {
 
-  std::string sha1(const std::string& data);
+  enum class algorithm {
+    sha1,
+    xxh3,
+    xxh128,
+  };
+
+  std::optional<algorithm> parse_algorithm(std::string_view name);
+  std::string_view algorithm_name(algorithm algo);
+
+  std::string sha1(std::string_view data);
+  std::string xxh3(std::string_view data);
+  std::string xxh128(std::string_view data);
+
+  std::string digest(algorithm algo, std::string_view data);
+
+  // Inputs larger than this are hashed as a tree of independently hashed
+  // chunks (xxh3/xxh128 only), which lets large files use every core.
+  constexpr size_t tree_chunk_size = 8 * 1024 * 1024;
+
+  std::string tree_digest(algorithm algo, std::string_view data);
+
+  class stream {
+  public:
+    explicit stream(algorithm algo = algorithm::sha1);
+    ~stream();
+
+    void update(std::string_view data);
+    std::string digest();
+
+  private:
+    struct state;
+
+    algorithm _algorithm;
+    std::unique_ptr<state> _state;
+  };
 
 } // namespace hashes
@@ -0,0 +1,234 @@
+#ifdef _WIN32
+  #include <process.h>
+#else
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <spdlog/spdlog.h>
+
+#include "./hash_cache.hpp"
+#include "./stats.hpp"
+
+using namespace std;
+using namespace std::filesystem;
+
+namespace {
+
+  constexpr auto header = "flatt-hashes 2";
+
+  // Files modified this recently may still change within the same
+  // timestamp tick, so their digests are not trusted (git's "racy clean").
+  constexpr int64_t racy_window_ns = 2'000'000'000;
+
+  struct entry {
+    hash_cache::file_stat stat;
+    string digest;
+    bool used = false;
+  };
+
+  struct state {
+    mutex lock;
+    path file;
+    unordered_map<string, entry> entries;
+    bool enabled = false;
+    bool dirty = false;
+  };
+
+  state &cache() {
+    static state instance;
+    return instance;
+  }
+
+  // "<algorithm> <absolute path>", which is also how entries are stored on disk
+  string key(const path &p, hashes::algorithm algo) {
+    auto name = string(hashes::algorithm_name(algo));
+    name += ' ';
+    name += absolute(p).lexically_normal().generic_string();
+    return name;
+  }
+
+  int64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+} // namespace
+
+optional<hash_cache::file_stat> hash_cache::stat(const path &p) {
+#ifdef _WIN32
+  error_code ec;
+  auto size = file_size(p, ec);
+  if (ec) {
+    return {};
+  }
+  auto time = last_write_time(p, ec);
+  if (ec) {
+    return {};
+  }
+  auto system_time = chrono::clock_cast<chrono::system_clock>(time);
+  return file_stat{
+    .size = size,
+    .mtime_ns = chrono::duration_cast<chrono::nanoseconds>(system_time.time_since_epoch()).count(),
+    .inode = 0,
+  };
+#else
+  struct ::stat info;
+  if (::stat(p.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+    return {};
+  }
+  return file_stat{
+    .size = static_cast<uint64_t>(info.st_size),
+    .mtime_ns = static_cast<int64_t>(info.st_mtim.tv_sec) * 1'000'000'000 + info.st_mtim.tv_nsec,
+    .inode = static_cast<uint64_t>(info.st_ino),
+  };
+#endif
+}
+
+void hash_cache::open(const path &file) {
+  auto &c = cache();
+  auto lock = unique_lock(c.lock);
+
+  // reopening the same cache (watch mode) keeps what is already in memory
+  if (c.enabled && c.file == file) {
+    return;
+  }
+
+  c.file = file;
+  c.entries.clear();
+  c.enabled = true;
+  c.dirty = false;
+
+  ifstream ifs(file, ios::binary);
+  if (!ifs.is_open()) {
+    return;
+  }
+
+  string line;
+  if (!getline(ifs, line) || line != header) {
+    spdlog::debug("Ignoring outdated hash cache: {}", file.string());
+    return;
+  }
+
+  // size mtime_ns inode digest algorithm path
+  while (getline(ifs, line)) {
+    auto current = entry{};
+    auto offset = 0;
+    if (sscanf(
+          line.c_str(), "%llu %lld %llu %n", (unsigned long long *)&current.stat.size,
+          (long long *)&current.stat.mtime_ns, (unsigned long long *)&current.stat.inode, &offset) != 3) {
+      continue;
+    }
+
+    auto rest = string_view(line).substr(offset);
+    auto space = rest.find(' ');
+    if (space == string_view::npos) {
+      continue;
+    }
+
+    current.digest = string(rest.substr(0, space));
+    c.entries.emplace(string(rest.substr(space + 1)), move(current));
+  }
+}
+
+bool hash_cache::save() {
+  auto &c = cache();
+  auto lock = unique_lock(c.lock);
+
+  if (!c.enabled || !c.dirty) {
+    return true;
+  }
+
+  error_code ec;
+  create_directories(c.file.parent_path(), ec);
+
+#ifdef _WIN32
+  auto pid = _getpid();
+#else
+  auto pid = getpid();
+#endif
+  // other flatt processes of the project (parallel build edges) save too
+  static auto saves = atomic<unsigned>{ 0 };
+  auto temp = c.file;
+  temp += "." + to_string(pid) + "." + to_string(saves++) + ".tmp";
+
+  {
+    ofstream ofs(temp, ios::binary | ios::trunc);
+    if (!ofs.is_open()) {
+      return false;
+    }
+
+    ofs << header << '\n';
+    for (auto &[name, current] : c.entries) {
+      // entries that weren't needed this run are kept only while the file exists
+      if (!current.used && !exists(name.substr(name.find(' ') + 1), ec)) {
+        continue;
+      }
+      ofs << current.stat.size << ' ' << current.stat.mtime_ns << ' ' << current.stat.inode << ' ' << current.digest
+          << ' ' << name << '\n';
+    }
+
+    if (!ofs.good()) {
+      ofs.close();
+      remove(temp, ec);
+      return false;
+    }
+  }
+
+  rename(temp, c.file, ec);
+  if (ec) {
+    spdlog::debug("Unable to save hash cache: {}", ec.message());
+    remove(temp, ec);
+    return false;
+  }
+
+  c.dirty = false;
+  return true;
+}
+
+optional<string> hash_cache::lookup(const path &p, hashes::algorithm algo, const file_stat &stat) {
+  auto name = key(p, algo);
+
+  auto &c = cache();
+  auto lock = unique_lock(c.lock);
+  if (!c.enabled) {
+    return {};
+  }
+
+  auto found = c.entries.find(name);
+  if (found == c.entries.end() || found->second.stat != stat) {
+    stats::add(stats::counter::hash_cache_misses);
+    return {};
+  }
+
+  stats::add(stats::counter::hash_cache_hits);
+  found->second.used = true;
+  return found->second.digest;
+}
+
+void hash_cache::store(const path &p, hashes::algorithm algo, const file_stat &stat, const string &digest) {
+  if (now_ns() - stat.mtime_ns < racy_window_ns) {
+    return;
+  }
+
+  auto name = key(p, algo);
+  if (name.find('\n') != string::npos) {
+    return;
+  }
+
+  auto &c = cache();
+  auto lock = unique_lock(c.lock);
+  if (!c.enabled) {
+    return;
+  }
+
+  c.entries[name] = entry{ .stat = stat, .digest = digest, .used = true };
+  c.dirty = true;
+}
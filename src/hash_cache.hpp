@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+
+#include "./hash.hpp"
+
+namespace hash_cache {
+
+  struct file_stat {
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    uint64_t inode = 0;
+
+    bool operator==(const file_stat &) const = default;
+  };
+
+  std::optional<file_stat> stat(const std::filesystem::path &p);
+
+  // Loads the cache from `file`; lookups and stores are no-ops until then.
+  // Opening the file that is already loaded keeps the in-memory entries.
+  void open(const std::filesystem::path &file);
+  bool save();
+
+  std::optional<std::string> lookup(const std::filesystem::path &p, hashes::algorithm algo, const file_stat &stat);
+  void store(
+    const std::filesystem::path &p, hashes::algorithm algo, const file_stat &stat, const std::string &digest);
+
+} // namespace hash_cache
@@ -8,162 +8,449 @@
 
 #ifdef _WIN32
   #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
 #endif
 
+#include <cerrno>
 #include <string>
 #include <sstream>
 #include <iostream>
 #include <fstream>
-#include <numeric>
+#include <memory>
 #include <filesystem>
 
 #include <spdlog/spdlog.h>
 
 #include "./io.hpp"
+#include "./deps.hpp"
 #include "./hash.hpp"
+#include "./hash_cache.hpp"
+#include "./output.hpp"
+#include "./parallel.hpp"
+#include "./stats.hpp"
 #include "./strings.hpp"
+#include "./trace.hpp"
 
 using namespace std;
 using namespace std::filesystem;
 
+static constexpr size_t hash_chunk_size = 64 * 1024;
+
+// smaller files are read rather than mapped, which is cheaper for them and
+// can't fault if the file is truncated while in use
+static constexpr size_t map_threshold = 1024 * 1024;
+
 path io::get_file_directory(string p) {
   return path(p.c_str()).parent_path();
 }
 
 path io::get_current_executable_directory() {
-  char buffer[2048];
+  char buffer[2048] = { 0 };
 #ifdef _WIN32
   GetModuleFileNameA(nullptr, buffer, sizeof(buffer));
+#else
+  auto length = readlink("/proc/self/exe", buffer, sizeof(buffer) - 1);
+  buffer[length > 0 ? length : 0] = '\0';
 #endif
 
   return get_file_directory(buffer);
 }
 
-pair<bool, string> io::read_file(path p) {
-  if (!exists(p)) {
-    return make_pair(false, string(""));
-  }
+io::mapped_file::mapped_file(mapped_file &&other) noexcept {
+  *this = move(other);
+}
 
-  ifstream ifs(p.string().c_str(), ios::binary);
-  stringstream dss;
-  dss << ifs.rdbuf();
-  return make_pair(true, dss.str());
+io::mapped_file::~mapped_file() {
+  release();
 }
 
-bool io::write_file(path p, string data) {
-  if (!exists(p)) {
-    try {
-      create_directories(p.parent_path());
-    } catch (...) {
-      // pass
+io::mapped_file &io::mapped_file::operator=(mapped_file &&other) noexcept {
+  if (this != &other) {
+    release();
+    if (other._mapped) {
+      _data = other._data;
+      _size = other._size;
+      _mapped = true;
+    } else {
+      adopt(move(other._buffer));
     }
+    other._data = nullptr;
+    other._size = 0;
+    other._mapped = false;
+    other._buffer = {};
   }
+  return *this;
+}
 
-  ofstream ofs(p.string().c_str(), ios::binary);
-  ofs.write(data.c_str(), data.size());
-  ofs.close();
-
-  return true;
+void io::mapped_file::release() {
+  if (_mapped && _data != nullptr) {
+#ifdef _WIN32
+    UnmapViewOfFile(_data);
+#else
+    munmap(const_cast<char *>(_data), _size);
+#endif
+  }
+  _data = nullptr;
+  _size = 0;
+  _mapped = false;
+  _buffer = {};
 }
 
-optional<string> io::hash_file(path p) {
-  auto [exists, data] = read_file(p);
-  return exists ? hashes::sha1(data) : optional<string>{};
+void io::mapped_file::adopt(string buffer) {
+  _buffer = move(buffer);
+  _data = _buffer.empty() ? nullptr : _buffer.data();
+  _size = _buffer.size();
+  _mapped = false;
 }
 
-optional<string> io::hash_dir(path p) {
-  auto hashes = vector<string>{};
+optional<io::mapped_file> io::map_file(const path &p) {
+  if (output::pending(p)) {
+    output::flush();
+  }
 
-  if (!filesystem::exists(p)) {
+  auto traced = trace::span("io", "read");
+  traced.arg("file", p.string());
+
+  auto mapped = mapped_file{};
+
+#ifdef _WIN32
+  auto file = CreateFileW(
+    p.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return {};
+  }
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size)) {
+    CloseHandle(file);
+    return {};
+  }
+
+  if (size.QuadPart > 0) {
+    auto mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr) {
+      CloseHandle(file);
+      return {};
+    }
+
+    // the view keeps the mapping alive after both handles are closed
+    auto data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (data == nullptr) {
+      CloseHandle(file);
+      return {};
+    }
+
+    mapped._data = static_cast<const char *>(data);
+    mapped._size = static_cast<size_t>(size.QuadPart);
+    mapped._mapped = true;
+  } else {
+    // devices and pipes report no size but may still have contents
+    auto buffer = string{};
+    char chunk[16 * 1024];
+    DWORD count = 0;
+    while (ReadFile(file, chunk, sizeof(chunk), &count, nullptr) && count > 0) {
+      buffer.append(chunk, count);
+    }
+    mapped.adopt(move(buffer));
+  }
+
+  CloseHandle(file);
+#else
+  auto fd = open(p.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return {};
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || S_ISDIR(info.st_mode)) {
+    close(fd);
     return {};
   }
 
-  auto it = recursive_directory_iterator(p);
-  for (auto dir : it) {
-    if (dir.is_regular_file()) {
-      auto hash = hash_file(dir);
-      if (hash.has_value()) {
-        hashes.push_back(hash.value());
+  if (S_ISREG(info.st_mode) && static_cast<size_t>(info.st_size) >= map_threshold) {
+    auto data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return {};
+    }
+
+    madvise(data, info.st_size, MADV_SEQUENTIAL);
+
+    mapped._data = static_cast<const char *>(data);
+    mapped._size = static_cast<size_t>(info.st_size);
+    mapped._mapped = true;
+  } else {
+    // FIFOs and /proc files have no (or a wrong) size, read until EOF
+    auto buffer = string{};
+    buffer.reserve(S_ISREG(info.st_mode) ? static_cast<size_t>(info.st_size) : 0);
+    char chunk[16 * 1024];
+    for (;;) {
+      auto count = ::read(fd, chunk, sizeof(chunk));
+      if (count < 0 && errno == EINTR) {
+        continue;
+      }
+      if (count < 0) {
+        close(fd);
+        return {};
+      }
+      if (count == 0) {
+        break;
       }
+      buffer.append(chunk, static_cast<size_t>(count));
     }
+    mapped.adopt(move(buffer));
   }
 
-  sort(hashes.begin(), hashes.end());
+  close(fd);
+#endif
+
+  // files probed but missing aren't inputs, a depfile listing them would
+  // never be satisfied
+  deps::read(p);
+  stats::add(stats::counter::files_read);
+  stats::add(stats::counter::bytes_read, mapped.size());
+  traced.arg("bytes", static_cast<int64_t>(mapped.size()));
+  return mapped;
+}
 
-  auto str = string("");
-  for (auto hash : hashes) {
-    str += hash;
+pair<bool, string> io::read_file(path p) {
+  auto mapped = map_file(p);
+  if (!mapped.has_value()) {
+    return make_pair(false, string(""));
   }
 
-  return hashes::sha1(str);
+  return make_pair(true, string(mapped->view()));
 }
 
-vector<path> io::list_dirs(const path& dir) {
-  if (!filesystem::exists(dir) || !filesystem::is_directory(dir)) {
+bool io::write_file(path p, string data) {
+  return output::write(p, data);
+}
+
+optional<string> io::hash_file(path p, hashes::algorithm algo) {
+  if (output::pending(p)) {
+    output::flush();
+  }
+
+  auto traced = trace::span("hash", "hash_file");
+  traced.arg("file", p.string());
+
+  auto stat = hash_cache::stat(p);
+  if (!stat.has_value()) {
     return {};
   }
+  deps::read(p);
 
-  auto root = absolute(dir);
-  auto result = vector<path>{};
-  for (auto entry : recursive_directory_iterator(root)) {
-    if (!entry.is_directory()) {
-      continue;
+  auto cached = hash_cache::lookup(p, algo, stat.value());
+  traced.arg("cached", cached.has_value() ? 1 : 0).arg("bytes", static_cast<int64_t>(stat->size));
+  if (cached.has_value()) {
+    return cached;
+  }
+
+  auto digest = optional<string>{};
+  if (algo != hashes::algorithm::sha1 && stat->size > hashes::tree_chunk_size) {
+    auto mapped = map_file(p);
+    if (mapped.has_value()) {
+      digest = hashes::tree_digest(algo, mapped->view());
+    }
+  } else {
+    ifstream ifs(p, ios::binary);
+    if (!ifs.is_open()) {
+      return {};
+    }
+
+    auto hasher = hashes::stream(algo);
+    auto buffer = make_unique<char[]>(hash_chunk_size);
+    while (ifs.read(buffer.get(), hash_chunk_size) || ifs.gcount() > 0) {
+      hasher.update(string_view(buffer.get(), static_cast<size_t>(ifs.gcount())));
+    }
+
+    if (!ifs.bad()) {
+      digest = hasher.digest();
+      stats::add(stats::counter::files_read);
+      stats::add(stats::counter::bytes_read, stat->size);
     }
-    result.push_back(filesystem::relative(entry, root));
   }
 
-  return result;
+  if (digest.has_value()) {
+    hash_cache::store(p, algo, stat.value(), digest.value());
+  }
+
+  return digest;
 }
 
-vector<path> io::list_files(const path& dir) {
-  if (!filesystem::exists(dir) || !filesystem::is_directory(dir)) {
+optional<string> io::hash_dir(path p, hashes::algorithm algo) {
+  // queued writes may land in the directory
+  output::flush();
+
+  if (!filesystem::exists(p)) {
     return {};
   }
 
-  auto root = absolute(dir);
-  auto result = vector<path>{};
-  for (auto entry : recursive_directory_iterator(root)) {
-    if (!entry.is_regular_file()) {
+  auto files = vector<pair<string, path>>{};
+  for (auto &entry : recursive_directory_iterator(p)) {
+    if (entry.is_regular_file()) {
+      files.emplace_back(entry.path().lexically_relative(p).generic_string(), entry.path());
+    }
+  }
+
+  // hash in path order so the result doesn't depend on traversal or scheduling
+  sort(files.begin(), files.end());
+
+  auto traced = trace::span("hash", "hash_dir");
+  traced.arg("dir", p.string()).arg("files", static_cast<int64_t>(files.size()));
+
+  auto digests = vector<optional<string>>(files.size());
+  parallel::for_each(files.size(), [&](size_t index) {
+    digests[index] = hash_file(files[index].second, algo);
+  });
+
+  auto hasher = hashes::stream(algo);
+  for (size_t i = 0; i < files.size(); i++) {
+    if (!digests[i].has_value()) {
       continue;
     }
-    result.push_back(filesystem::relative(entry, root));
+    hasher.update(files[i].first);
+    hasher.update(string_view("\0", 1));
+    hasher.update(digests[i].value());
+    hasher.update("\n");
+  }
+
+  return hasher.digest();
+}
+
+vector<path> io::list_dirs(const path& dir) {
+  auto result = vector<path>{};
+  auto it = walker(dir, { .files = false, .dirs = true });
+  for (auto entry = it.next(); entry.has_value(); entry = it.next()) {
+    result.emplace_back(move(entry.value()));
+  }
+
+  return result;
+}
+
+vector<path> io::list_files(const path& dir) {
+  auto result = vector<path>{};
+  auto it = walker(dir);
+  for (auto entry = it.next(); entry.has_value(); entry = it.next()) {
+    result.emplace_back(move(entry.value()));
   }
 
   return result;
 }
 
-int io::shell(string command, vector<string> args, path p, path output) {
-  if (p.empty()) {
-    p = get_file_directory(command);
+static bool matches_any(const vector<string> &patterns, string_view relative) {
+  auto name = relative.substr(relative.find_last_of('/') + 1);
+  for (auto &pattern : patterns) {
+    auto subject = pattern.find('/') == string::npos ? name : relative;
+    if (str::glob_match(pattern, subject)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+io::walker::walker(const path &root, walk_options opts, string base)
+  : _opts(move(opts))
+  , _base(move(base)) {
+  // queued writes may add files to the listing
+  output::flush();
+
+  error_code ec;
+  _it = recursive_directory_iterator(root, directory_options::skip_permission_denied, ec);
+  if (ec) {
+    _it = {};
+    return;
   }
 
-  auto finalCommand = "\"" + command + "\" ";
-  if (!p.empty()) {
-    finalCommand = "cd \"" + p.string() + "\" && " + finalCommand;
+  // entries come back as `root / name`, so the relative part is a plain suffix
+  _prefix = root.native().size();
+  if (!root.native().empty() && root.native().back() != path::preferred_separator && root.native().back() != '/') {
+    _prefix += 1;
   }
+}
+
+optional<string> io::walker::next() {
+  error_code ec;
+  while (_it != recursive_directory_iterator()) {
+    auto &entry = *_it;
+    auto depth = _it.depth();
+    auto is_dir = entry.is_directory(ec);
+    auto is_file = !is_dir && entry.is_regular_file(ec);
 
-  auto finalArgs = accumulate(next(args.begin()), args.end(), args[0], [](auto a, auto b) {
-    if (b.find(' ') != string::npos || b == "") {
-      b = "\"" + b + "\"";
+#ifdef _WIN32
+    auto relative = _base + path(entry.path().native().substr(_prefix)).generic_string();
+#else
+    auto relative = _base + entry.path().native().substr(_prefix);
+#endif
+
+    auto excluded = matches_any(_opts.exclude, relative);
+    if (is_dir && (excluded || (_opts.max_depth >= 0 && depth >= _opts.max_depth))) {
+      _it.disable_recursion_pending();
     }
-    return a + " " + b;
-  });
 
-  auto final = finalCommand + finalArgs;
-  spdlog::trace("");
-  spdlog::trace(" shell: {}", final);
-  spdlog::trace("");
+    _it.increment(ec);
+    if (ec) {
+      _it = {};
+    }
+
+    if (excluded || (is_dir && !_opts.dirs) || (is_file && !_opts.files) || (!is_dir && !is_file)) {
+      continue;
+    }
+
+    if (!_opts.include.empty() && !matches_any(_opts.include, relative)) {
+      continue;
+    }
 
-  if (!output.empty()) {
-    return system((final + " > \"" + output.string() + "\"").c_str());
+    return relative;
   }
 
-  return system(final.c_str());
+  return {};
 }
 
-string io::shell_output(string command, vector<string> args, path p) {
-  std::string file = std::tmpnam(nullptr);
-  io::shell(command, args, p, file);
-  auto [_, output] = io::read_file(file);
-  return output;
+vector<string> io::walk_parallel(const path &root, const walk_options &opts) {
+  auto result = vector<string>{};
+  auto subdirs = vector<string>{};
+
+  // the top level runs inline to find the subtrees to fan out
+  auto top = opts;
+  top.max_depth = 0;
+  top.dirs = true;
+  top.include.clear();
+
+  auto it = walker(root, top);
+  for (auto entry = it.next(); entry.has_value(); entry = it.next()) {
+    auto entry_path = root / entry.value();
+    error_code ec;
+    auto is_dir = filesystem::is_directory(entry_path, ec);
+
+    if ((is_dir ? opts.dirs : opts.files) && (opts.include.empty() || matches_any(opts.include, entry.value()))) {
+      result.push_back(entry.value());
+    }
+    if (is_dir && opts.max_depth != 0) {
+      subdirs.push_back(move(entry.value()));
+    }
+  }
+
+  auto nested = vector<vector<string>>(subdirs.size());
+  parallel::for_each(subdirs.size(), [&](size_t index) {
+    auto child = opts;
+    child.max_depth = opts.max_depth < 0 ? -1 : opts.max_depth - 1;
+
+    auto sub = walker(root / subdirs[index], child, subdirs[index] + "/");
+    for (auto entry = sub.next(); entry.has_value(); entry = sub.next()) {
+      nested[index].push_back(move(entry.value()));
+    }
+  });
+
+  for (auto &entries : nested) {
+    result.insert(result.end(), make_move_iterator(entries.begin()), make_move_iterator(entries.end()));
+  }
+
+  return result;
 }
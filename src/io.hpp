@@ -1,28 +1,94 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <optional>
 #include <filesystem>
 
+#include "./hash.hpp"
+
 namespace io {
 
   std::filesystem::path get_file_directory(std::string p);
   std::filesystem::path get_current_executable_directory();
 
+  // A file's contents, mapped or, for small and non-regular files, read into
+  // an owned buffer.
+  class mapped_file {
+  public:
+    mapped_file() = default;
+    mapped_file(const mapped_file &) = delete;
+    mapped_file(mapped_file &&other) noexcept;
+    ~mapped_file();
+
+    mapped_file &operator=(const mapped_file &) = delete;
+    mapped_file &operator=(mapped_file &&other) noexcept;
+
+    const char *data() const {
+      return _data;
+    }
+
+    size_t size() const {
+      return _size;
+    }
+
+    std::string_view view() const {
+      return std::string_view(_data, _size);
+    }
+
+  private:
+    friend std::optional<mapped_file> map_file(const std::filesystem::path &p);
+
+    void release();
+    void adopt(std::string buffer);
+
+    const char *_data = nullptr;
+    size_t _size = 0;
+    bool _mapped = false;
+    std::string _buffer;
+  };
+
+  std::optional<mapped_file> map_file(const std::filesystem::path &p);
+
   std::pair<bool, std::string> read_file(std::filesystem::path p);
   bool write_file(std::filesystem::path p, std::string data);
 
-  std::optional<std::string> hash_file(std::filesystem::path p);
-  std::optional<std::string> hash_dir(std::filesystem::path p);
+  std::optional<std::string> hash_file(
+    std::filesystem::path p, hashes::algorithm algo = hashes::algorithm::sha1);
+  std::optional<std::string> hash_dir(
+    std::filesystem::path p, hashes::algorithm algo = hashes::algorithm::sha1);
 
   std::vector<std::filesystem::path> list_dirs(const std::filesystem::path& dir);
   std::vector<std::filesystem::path> list_files(const std::filesystem::path& dir);
 
-  int shell(
-    std::string command, std::vector<std::string> args, std::filesystem::path p = "",
-    std::filesystem::path output = "");
+  struct walk_options {
+    // Glob patterns (see str::glob_match) tested against the path relative to
+    // the walked directory; patterns without a '/' are tested against the name.
+    std::vector<std::string> include;
+    // Excluded directories are not descended into.
+    std::vector<std::string> exclude;
+    // Deepest level to report, 0 being the walked directory's entries (-1 = no limit).
+    int max_depth = -1;
+    bool files = true;
+    bool dirs = false;
+  };
+
+  class walker {
+  public:
+    walker(const std::filesystem::path &root, walk_options opts = {}, std::string base = "");
+
+    // Next matching entry relative to the root, with '/' separators.
+    std::optional<std::string> next();
+
+  private:
+    walk_options _opts;
+    std::string _base;
+    size_t _prefix = 0;
+    std::filesystem::recursive_directory_iterator _it;
+  };
 
-  std::string shell_output(std::string command, std::vector<std::string> args, std::filesystem::path p = "");
+  // Walks the top level subdirectories concurrently and returns every match at once.
+  std::vector<std::string> walk_parallel(const std::filesystem::path &root, const walk_options &opts = {});
 
 } // namespace io
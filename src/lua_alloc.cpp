@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "./lua_alloc.hpp"
+
+using namespace std;
+
+lua_alloc::allocator::allocator(size_t limit) : _limit(limit) {}
+
+lua_alloc::allocator::~allocator() {
+  for (auto slab : _slabs) {
+    free(slab);
+  }
+  for (auto block : _adopted) {
+    free(block);
+  }
+}
+
+void *lua_alloc::allocator::take(size_t size) {
+  if (size > granularity * classes) {
+    return malloc(size);
+  }
+
+  size = (size + granularity - 1) / granularity * granularity;
+  auto &list = _free[size / granularity - 1];
+  if (list != nullptr) {
+    auto block = list;
+    list = *static_cast<void **>(block);
+    _counters.pooled++;
+    return block;
+  }
+
+  // the rest of a slab too short for this class is left unused
+  if (_left < size) {
+    auto slab = static_cast<char *>(malloc(slab_size));
+    if (slab == nullptr) {
+      return nullptr;
+    }
+    _slabs.push_back(slab);
+    _current = slab;
+    _left = slab_size;
+    _counters.reserved += slab_size;
+  }
+
+  auto block = _current;
+  _current += size;
+  _left -= size;
+  _counters.pooled++;
+  return block;
+}
+
+void lua_alloc::allocator::release(void *ptr, size_t size) {
+  if (size > granularity * classes) {
+    free(ptr);
+    return;
+  }
+
+  size = (size + granularity - 1) / granularity * granularity;
+  auto &list = _free[size / granularity - 1];
+  *static_cast<void **>(ptr) = list;
+  list = ptr;
+}
+
+void *lua_alloc::allocator::reallocate(void *ptr, size_t old_size, size_t new_size) {
+  if (new_size == 0) {
+    if (ptr != nullptr) {
+      release(ptr, old_size);
+      _counters.bytes -= old_size;
+    }
+    return nullptr;
+  }
+
+  // shrinking must not fail, Lua doesn't expect it to
+  if (_limit != 0 && new_size > old_size && _counters.bytes - old_size + new_size > _limit) {
+    _counters.refused++;
+    return nullptr;
+  }
+
+  auto small = granularity * classes;
+  auto same_class = [&]() {
+    return (old_size + granularity - 1) / granularity == (new_size + granularity - 1) / granularity;
+  };
+
+  void *result = nullptr;
+  if (ptr != nullptr && old_size <= small && new_size <= small && same_class()) {
+    result = ptr;
+  } else if (ptr != nullptr && old_size > small && new_size > small) {
+    result = realloc(ptr, new_size);
+    if (result == nullptr && new_size <= old_size) {
+      result = ptr;
+    } else if (result == nullptr) {
+      return nullptr;
+    }
+  } else {
+    result = take(new_size);
+    if (result == nullptr && ptr != nullptr && new_size <= old_size) {
+      // no slab for the smaller class: keep the block, a large one becomes
+      // a pool block of its new class and is freed with the allocator
+      if (old_size > small) {
+        _adopted.push_back(ptr);
+      }
+      result = ptr;
+    } else if (result == nullptr) {
+      return nullptr;
+    } else if (ptr != nullptr) {
+      memcpy(result, ptr, min(old_size, new_size));
+      release(ptr, old_size);
+    }
+  }
+
+  if (ptr == nullptr) {
+    _counters.allocations++;
+  }
+  _counters.bytes = _counters.bytes - old_size + new_size;
+  _counters.peak = max(_counters.peak, _counters.bytes);
+  return result;
+}
+
+const lua_alloc::counters &lua_alloc::allocator::counters() const {
+  return _counters;
+}
+
+size_t lua_alloc::allocator::limit() const {
+  return _limit;
+}
+
+void *lua_alloc::allocate(void *ud, void *ptr, size_t osize, size_t nsize) {
+  // without a block, Lua 5.2+ passes the kind of object in `osize`
+  return static_cast<allocator *>(ud)->reallocate(ptr, ptr == nullptr ? 0 : osize, nsize);
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace lua_alloc {
+
+  struct counters {
+    // bytes Lua holds now and at most so far
+    size_t bytes = 0;
+    size_t peak = 0;
+    size_t allocations = 0;
+    // allocations served by the size class pools instead of malloc
+    size_t pooled = 0;
+    // bytes taken from malloc for pool slabs
+    size_t reserved = 0;
+    // allocations refused for going over the limit
+    size_t refused = 0;
+  };
+
+  // Memory for one lua_State: blocks up to 512 bytes (strings, tables,
+  // closures, upvalues) come from per size class free lists, carved off
+  // 64 KiB slabs by bumping a pointer; larger ones go to malloc. Slabs are
+  // only freed with the allocator, which has to outlive the state. Not
+  // thread safe, like the state itself.
+  class allocator {
+  public:
+    // Refuses to grow Lua's memory past `limit` bytes (0 = no limit); Lua
+    // then collects garbage and raises "not enough memory" if that fails.
+    explicit allocator(size_t limit = 0);
+    allocator(const allocator &) = delete;
+    ~allocator();
+
+    allocator &operator=(const allocator &) = delete;
+
+    void *reallocate(void *ptr, size_t old_size, size_t new_size);
+
+    const lua_alloc::counters &counters() const;
+    size_t limit() const;
+
+  private:
+    static constexpr size_t granularity = 16;
+    static constexpr size_t classes = 32;
+    static constexpr size_t slab_size = 64 * 1024;
+
+    void *take(size_t size);
+    void release(void *ptr, size_t size);
+
+    size_t _limit;
+    void *_free[classes] = {};
+    std::vector<void *> _slabs;
+    // malloc'd blocks kept when shrinking them into a pool failed
+    std::vector<void *> _adopted;
+    char *_current = nullptr;
+    size_t _left = 0;
+    lua_alloc::counters _counters;
+  };
+
+  // The lua_Alloc function, with the allocator as its user data:
+  // `lua_newstate(lua_alloc::allocate, &allocator)`.
+  void *allocate(void *ud, void *ptr, size_t osize, size_t nsize);
+
+} // namespace lua_alloc
@@ -0,0 +1,450 @@
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "./lua_json.hpp"
+
+using namespace std;
+using namespace nlohmann;
+
+namespace {
+
+  // Lua can't store nil in tables, so null is a unique light userdata.
+  char null_sentinel;
+
+  bool is_null(lua_State *L, int index) {
+    return lua_islightuserdata(L, index) && lua_touserdata(L, index) == &null_sentinel;
+  }
+
+  void push_null(lua_State *L) {
+    lua_pushlightuserdata(L, &null_sentinel);
+  }
+
+  // Builds the Lua value directly on the stack while nlohmann's SAX parser
+  // walks the text, without an intermediate json document.
+  class decoder : public json_sax<json> {
+  public:
+    explicit decoder(lua_State *L)
+      : _L(L) {
+    }
+
+    const std::string &error() const {
+      return _error;
+    }
+
+    bool null() override {
+      push_null(_L);
+      return attach();
+    }
+
+    bool boolean(bool value) override {
+      lua_pushboolean(_L, value);
+      return attach();
+    }
+
+    bool number_integer(number_integer_t value) override {
+      lua_pushinteger(_L, static_cast<lua_Integer>(value));
+      return attach();
+    }
+
+    bool number_unsigned(number_unsigned_t value) override {
+      if (value > static_cast<number_unsigned_t>(numeric_limits<lua_Integer>::max())) {
+        lua_pushnumber(_L, static_cast<lua_Number>(value));
+      } else {
+        lua_pushinteger(_L, static_cast<lua_Integer>(value));
+      }
+      return attach();
+    }
+
+    bool number_float(number_float_t value, const string_t &) override {
+      lua_pushnumber(_L, static_cast<lua_Number>(value));
+      return attach();
+    }
+
+    bool string(string_t &value) override {
+      lua_pushlstring(_L, value.data(), value.size());
+      return attach();
+    }
+
+    bool binary(binary_t &) override {
+      _error = "binary values are not supported";
+      return false;
+    }
+
+    bool start_object(size_t size) override {
+      return open(false, size);
+    }
+
+    bool key(string_t &value) override {
+      lua_pushlstring(_L, value.data(), value.size());
+      return true;
+    }
+
+    bool end_object() override {
+      _frames.pop_back();
+      return attach();
+    }
+
+    bool start_array(size_t size) override {
+      return open(true, size);
+    }
+
+    bool end_array() override {
+      _frames.pop_back();
+      return attach();
+    }
+
+    bool parse_error(size_t, const std::string &, const detail::exception &ex) override {
+      _error = ex.what();
+      return false;
+    }
+
+  private:
+    struct frame {
+      bool array;
+      lua_Integer length;
+    };
+
+    bool open(bool array, size_t size) {
+      // a table, a pending key and a value per level
+      if (!lua_checkstack(_L, 3)) {
+        _error = "document is nested too deeply";
+        return false;
+      }
+
+      auto hint = size == static_cast<size_t>(-1) ? 0 : static_cast<int>(min<size_t>(size, 1 << 20));
+      lua_createtable(_L, array ? hint : 0, array ? 0 : hint);
+      _frames.push_back(frame{ .array = array, .length = 0 });
+      return true;
+    }
+
+    // Moves the value on top of the stack into the enclosing table; the
+    // document's root stays on the stack.
+    bool attach() {
+      if (_frames.empty()) {
+        return true;
+      }
+
+      auto &parent = _frames.back();
+      if (parent.array) {
+        lua_rawseti(_L, -2, ++parent.length);
+      } else {
+        lua_rawset(_L, -3);
+      }
+      return true;
+    }
+
+    lua_State *_L;
+    vector<frame> _frames;
+    std::string _error;
+  };
+
+  struct encode_options {
+    bool sort_keys = false;
+    int indent = -1;
+  };
+
+  constexpr int max_depth = 1000;
+
+  void append_string(std::string &out, string_view value) {
+    constexpr char hex[] = "0123456789abcdef";
+
+    out += '"';
+    for (unsigned char c : value) {
+      switch (c) {
+      case '"':
+        out += "\\\"";
+        break;
+      case '\\':
+        out += "\\\\";
+        break;
+      case '\b':
+        out += "\\b";
+        break;
+      case '\f':
+        out += "\\f";
+        break;
+      case '\n':
+        out += "\\n";
+        break;
+      case '\r':
+        out += "\\r";
+        break;
+      case '\t':
+        out += "\\t";
+        break;
+      default:
+        if (c < 0x20) {
+          out += "\\u00";
+          out += hex[c >> 4];
+          out += hex[c & 0xf];
+        } else {
+          out += static_cast<char>(c);
+        }
+      }
+    }
+    out += '"';
+  }
+
+  void append_number(std::string &out, lua_State *L, int index) {
+    char buffer[32];
+
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(L, index)) {
+      auto [end, ec] = to_chars(buffer, buffer + sizeof(buffer), lua_tointeger(L, index));
+      out.append(buffer, end);
+      return;
+    }
+#endif
+
+    auto value = lua_tonumber(L, index);
+    if (!isfinite(value)) {
+      out += "null";
+      return;
+    }
+
+    // integral doubles print without a fraction, as Lua 5.1 code expects
+    if (value == floor(value) && fabs(value) < 9007199254740992.0) {
+      auto [end, ec] = to_chars(buffer, buffer + sizeof(buffer), static_cast<long long>(value));
+      out.append(buffer, end);
+      return;
+    }
+
+    auto [end, ec] = to_chars(buffer, buffer + sizeof(buffer), value);
+    out.append(buffer, end);
+  }
+
+  void newline(std::string &out, const encode_options &opts, int depth) {
+    if (opts.indent >= 0) {
+      out += '\n';
+      out.append(static_cast<size_t>(opts.indent) * depth, ' ');
+    }
+  }
+
+  // Length of the table at `index` when its keys are exactly 1..n (0 for an
+  // empty one, which templates loop over as a list), else -1.
+  lua_Integer array_length(lua_State *L, int index) {
+    auto count = lua_Integer{ 0 };
+    auto max = lua_Integer{ 0 };
+
+    lua_pushnil(L);
+    while (lua_next(L, index) != 0) {
+      lua_pop(L, 1);
+      if (lua_type(L, -1) != LUA_TNUMBER) {
+        lua_pop(L, 1);
+        return -1;
+      }
+      auto key = lua_tonumber(L, -1);
+      if (key < 1 || key != floor(key)) {
+        lua_pop(L, 1);
+        return -1;
+      }
+      max = std::max(max, static_cast<lua_Integer>(key));
+      count++;
+    }
+
+    return count == max ? count : -1;
+  }
+
+  bool encode_value(std::string &out, lua_State *L, int index, const encode_options &opts, int depth, std::string &error);
+
+  bool encode_table(std::string &out, lua_State *L, int index, const encode_options &opts, int depth, std::string &error) {
+    if (depth >= max_depth) {
+      error = "table is nested too deeply (or contains a cycle)";
+      return false;
+    }
+    if (!lua_checkstack(L, 4)) {
+      error = "out of stack space";
+      return false;
+    }
+
+    auto length = array_length(L, index);
+    if (length >= 0) {
+      out += '[';
+      for (lua_Integer i = 1; i <= length; i++) {
+        if (i > 1) {
+          out += ',';
+        }
+        newline(out, opts, depth + 1);
+        lua_rawgeti(L, index, i);
+        auto ok = encode_value(out, L, lua_gettop(L), opts, depth + 1, error);
+        lua_pop(L, 1);
+        if (!ok) {
+          return false;
+        }
+      }
+      if (length > 0) {
+        newline(out, opts, depth);
+      }
+      out += ']';
+      return true;
+    }
+
+    // keys as strings (numbers are converted like other encoders do), along
+    // with what it takes to look the value up again
+    struct entry {
+      std::string name;
+      int type;
+      lua_Number number;
+#if LUA_VERSION_NUM >= 503
+      bool integer;
+      lua_Integer whole;
+#endif
+    };
+
+    auto keys = vector<entry>{};
+    lua_pushnil(L);
+    while (lua_next(L, index) != 0) {
+      lua_pop(L, 1);
+      auto type = lua_type(L, -1);
+      if (type != LUA_TSTRING && type != LUA_TNUMBER) {
+        lua_pop(L, 1);
+        error = "object keys must be strings or numbers";
+        return false;
+      }
+
+      auto key = entry{ .type = type, .number = type == LUA_TNUMBER ? lua_tonumber(L, -1) : 0 };
+#if LUA_VERSION_NUM >= 503
+      key.integer = type == LUA_TNUMBER && lua_isinteger(L, -1);
+      key.whole = key.integer ? lua_tointeger(L, -1) : 0;
+#endif
+      // a copy, lua_tolstring would turn the key lua_next needs into a string
+      lua_pushvalue(L, -1);
+      size_t size = 0;
+      auto name = lua_tolstring(L, -1, &size);
+      key.name.assign(name, size);
+      lua_pop(L, 1);
+
+      keys.push_back(move(key));
+    }
+
+    if (opts.sort_keys) {
+      sort(keys.begin(), keys.end(), [](const entry &a, const entry &b) {
+        return a.name < b.name;
+      });
+    }
+
+    out += '{';
+    auto first = true;
+    for (auto &key : keys) {
+      if (key.type == LUA_TSTRING) {
+        lua_pushlstring(L, key.name.data(), key.name.size());
+#if LUA_VERSION_NUM >= 503
+      } else if (key.integer) {
+        lua_pushinteger(L, key.whole);
+#endif
+      } else {
+        lua_pushnumber(L, key.number);
+      }
+      lua_rawget(L, index);
+
+      if (!first) {
+        out += ',';
+      }
+      first = false;
+      newline(out, opts, depth + 1);
+      append_string(out, key.name);
+      out += opts.indent >= 0 ? ": " : ":";
+
+      auto ok = encode_value(out, L, lua_gettop(L), opts, depth + 1, error);
+      lua_pop(L, 1);
+      if (!ok) {
+        return false;
+      }
+    }
+    if (!keys.empty()) {
+      newline(out, opts, depth);
+    }
+    out += '}';
+    return true;
+  }
+
+  bool encode_value(std::string &out, lua_State *L, int index, const encode_options &opts, int depth, std::string &error) {
+    switch (lua_type(L, index)) {
+    case LUA_TNIL:
+      out += "null";
+      return true;
+    case LUA_TBOOLEAN:
+      out += lua_toboolean(L, index) ? "true" : "false";
+      return true;
+    case LUA_TNUMBER:
+      append_number(out, L, index);
+      return true;
+    case LUA_TSTRING: {
+      size_t size = 0;
+      auto value = lua_tolstring(L, index, &size);
+      append_string(out, string_view(value, size));
+      return true;
+    }
+    case LUA_TTABLE:
+      return encode_table(out, L, index, opts, depth, error);
+    case LUA_TLIGHTUSERDATA:
+      if (is_null(L, index)) {
+        out += "null";
+        return true;
+      }
+      [[fallthrough]];
+    default:
+      error = std::string("unable to encode a ") + lua_typename(L, lua_type(L, index));
+      return false;
+    }
+  }
+
+} // namespace
+
+int lua_json::open(lua_State *L) {
+  lua_createtable(L, 0, 3);
+  lua_pushcfunction(L, decode);
+  lua_setfield(L, -2, "decode");
+  lua_pushcfunction(L, encode);
+  lua_setfield(L, -2, "encode");
+  push_null(L);
+  lua_setfield(L, -2, "null");
+  return 1;
+}
+
+int lua_json::decode(lua_State *L) {
+  size_t size = 0;
+  auto text = luaL_checklstring(L, 1, &size);
+
+  auto base = lua_gettop(L);
+  auto handler = decoder(L);
+  auto ok = json::sax_parse(string_view(text, size), &handler, json::input_format_t::json, true, true);
+  if (!ok) {
+    lua_settop(L, base);
+    lua_pushnil(L);
+    lua_pushstring(L, handler.error().empty() ? "invalid json" : handler.error().c_str());
+    return 2;
+  }
+
+  return 1;
+}
+
+int lua_json::encode(lua_State *L) {
+  auto opts = encode_options{};
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "sort_keys");
+    opts.sort_keys = lua_toboolean(L, -1);
+    lua_getfield(L, 2, "indent");
+    opts.indent = lua_isnumber(L, -1) ? static_cast<int>(lua_tointeger(L, -1)) : -1;
+    lua_pop(L, 2);
+  }
+  lua_settop(L, 1);
+
+  auto out = std::string{};
+  auto error = std::string{};
+  if (!encode_value(out, L, 1, opts, 0, error)) {
+    lua_pushnil(L);
+    lua_pushlstring(L, error.data(), error.size());
+    return 2;
+  }
+
+  lua_pushlstring(L, out.data(), out.size());
+  return 1;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <lua.hpp>
+
+namespace lua_json {
+
+  // json.decode(text) -> value | nil, error
+  // Objects and arrays become tables, null becomes json.null.
+  int decode(lua_State *L);
+
+  // json.encode(value, { sort_keys = false, indent = nil }) -> text | nil, error
+  // Tables whose keys are exactly 1..n encode as arrays, other tables as
+  // objects (an empty table is `[]`). Compact unless `indent` is given.
+  int encode(lua_State *L);
+
+  // Pushes the module table: decode, encode and the json.null sentinel.
+  int open(lua_State *L);
+
+} // namespace lua_json
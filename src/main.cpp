@@ -1,18 +1,29 @@
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <numeric>
 #include <regex>
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <optional>
 
+#include <argparse/argparse.hpp>
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
+#include <spdlog/sinks/stdout_sinks.h>
 
 #include <flatbuffers/reflection_generated.h>
 #include <flatbuffers/flatbuffers.h>
+#include <flatbuffers/idl.h>
 #include <flatbuffers/util.h>
 #include <flatbuffers/minireflect.h>
 
@@ -22,10 +33,32 @@
 
 #include <entt/core/hashed_string.hpp>
 
+#include "arena.hpp"
+#include "async.hpp"
+#include "bytecode.hpp"
+#include "deps.hpp"
 #include "io.hpp"
+#include "lua_alloc.hpp"
+#include "lua_json.hpp"
+#include "marshal.hpp"
+#include "output.hpp"
+#include "output_cache.hpp"
+#include "parallel.hpp"
+#include "process.hpp"
+#include "profiler.hpp"
+#include "stats.hpp"
 #include "strings.hpp"
 #include "templates.hpp"
+#include "trace.hpp"
 #include "hash.hpp"
+#include "hash_cache.hpp"
+#include "server.hpp"
+#include "tasks.hpp"
+#include "watch.hpp"
+
+#ifndef FLATT_VERSION
+  #define FLATT_VERSION "dev"
+#endif
 
 using namespace std;
 using namespace std::filesystem;
@@ -63,30 +96,50 @@ path find_executable(string bin) {
   }
 }
 
+// The client's environment during daemon runs (NAME=value entries), given
+// to the processes a run starts and to os.getenv. Unset for in-process runs,
+// which have the process' own.
+optional<vector<string>> run_environment;
+
+optional<string> environment_variable(const string &name) {
+  if (!run_environment.has_value()) {
+    auto value = getenv(name.c_str());
+    return value != nullptr ? optional<string>(value) : nullopt;
+  }
+  for (auto &entry : run_environment.value()) {
+    if (entry.size() > name.size() && entry[name.size()] == '=' && entry.starts_with(name)) {
+      return entry.substr(name.size() + 1);
+    }
+  }
+  return {};
+}
+
 path find_flatc() {
-  return find_executable("flatc");
+  static const auto flatc = find_executable("flatc");
+  return flatc;
 }
 
-int flatc(const path &working_dir, const vector<string> arguments) {
-  return io::shell(find_flatc().string(), arguments, working_dir);
+int flatc(const path &working_dir, const vector<string> &arguments) {
+  return process::run(find_flatc().string(), arguments, { .cwd = working_dir, .environment = run_environment })
+    .status;
 }
 
-json flac_parse_attributes(const flatbuffers::Vector<flatbuffers::Offset<reflection::KeyValue>> *list) {
-  auto attributes = json::object({});
+arena::json flac_parse_attributes(const flatbuffers::Vector<flatbuffers::Offset<reflection::KeyValue>> *list) {
+  auto attributes = arena::json::object({});
   if (list == nullptr) {
     return attributes;
   }
 
   for (int i = 0; i < list->size(); i++) {
     auto entry = list->Get(i);
-    attributes[entry->key()->str()] = entry->value()->str();
+    attributes[entry->key()->c_str()] = entry->value()->str();
   }
 
   return attributes;
 }
 
-json flac_parse_documentation(const flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String>> *list) {
-  auto documentation = json::array({});
+arena::json flac_parse_documentation(const flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String>> *list) {
+  auto documentation = arena::json::array({});
   if (list == nullptr) {
     return documentation;
   }
@@ -98,7 +151,7 @@ json flac_parse_documentation(const flatbuffers::Vector<flatbuffers::Offset<flat
   return documentation;
 }
 
-json flac_parse_documentation_text(const flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String>> *list) {
+arena::json flac_parse_documentation_text(const flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String>> *list) {
   string doc = "";
   if (list == nullptr) {
     return doc;
@@ -111,29 +164,8 @@ json flac_parse_documentation_text(const flatbuffers::Vector<flatbuffers::Offset
   return doc.substr(0, doc.size() - 1);
 }
 
-optional<string> flatc_reflection(const path &file) {
-  string location = std::tmpnam(nullptr);
-  filesystem::create_directories(location);
-
-  auto bfbs = path(location) / path(file).filename().replace_extension(".bfbs");
-
-  auto arguments = vector<string>{
-    "--binary", "--bfbs-gen-embed", "--bfbs-comments", "--bfbs-builtins",
-    "-o",       location.c_str(),   "--schema",        file.string(),
-  };
-
-  auto status = flatc(io::get_current_executable_directory(), arguments);
-  if (status != 0) {
-    return {};
-  }
-
-  auto [exists, buffer] = io::read_file(bfbs);
-  if (!exists) {
-    return {};
-  }
-
-  auto schema_ptr = reflection::GetSchema(buffer.c_str());
-  auto &schema = *schema_ptr;
+optional<string> schema_reflection(const reflection::Schema &schema) {
+  auto traced = trace::span("reflect", "build");
 
   auto objects = schema.objects();
   auto enums = schema.enums();
@@ -143,15 +175,19 @@ optional<string> flatc_reflection(const path &file) {
   auto file_ident = schema.file_ident() == nullptr ? "" : schema.file_ident()->str();
   auto file_ext = schema.file_ext() == nullptr ? "" : schema.file_ext()->str();
 
-  auto data = json({});
-  data["file_ident"] = json::string_t(file_ident);
-  data["file_ext"] = json::string_t(file_ext);
-  data["tables"] = json::array({});
-  data["structs"] = json::array({});
-  data["enums"] = json::array({});
-  data["services"] = json::array({});
-  data["files"] = json::array({});
-  data["advanced_features"] = json({});
+  // the DOM is large and thrown away right after the dump: build it in an
+  // arena and let the arena go instead of freeing it node by node
+  auto memory = arena::monotonic{};
+  auto scoped = arena::scope(memory);
+  auto &data = memory.make<arena::json>(arena::json::object());
+  data["file_ident"] = arena::json::string_t(file_ident);
+  data["file_ext"] = arena::json::string_t(file_ext);
+  data["tables"] = arena::json::array({});
+  data["structs"] = arena::json::array({});
+  data["enums"] = arena::json::array({});
+  data["services"] = arena::json::array({});
+  data["files"] = arena::json::array({});
+  data["advanced_features"] = arena::json({});
 
   // Types
 
@@ -215,8 +251,8 @@ optional<string> flatc_reflection(const path &file) {
 
   auto type_info = [&](const reflection::Type *type) {
     auto name = type_name(type->base_type());
-    auto data = json({
-      { "id", json::number_integer_t(entt::hashed_string::value(name.c_str())) },
+    auto data = arena::json({
+      { "id", arena::json::number_integer_t(entt::hashed_string::value(name.c_str())) },
       { "index", type->index() },
       { "name", name },
       { "size", type->base_size() },
@@ -237,20 +273,20 @@ optional<string> flatc_reflection(const path &file) {
     auto obj = objects->Get(i);
     auto name = obj->name()->str();
 
-    auto type = json({
-      { "id", json::number_integer_t(entt::hashed_string::value(name.c_str())) },
+    auto type = arena::json({
+      { "id", arena::json::number_integer_t(entt::hashed_string::value(name.c_str())) },
       { "name", name.substr(name.find_last_of('.') + 1) },
       { "namespace", name.substr(0, name.find_last_of('.')) },
       { "attributes", flac_parse_attributes(obj->attributes()) },
-      { "documentation", json({
+      { "documentation", arena::json({
                            { "text", flac_parse_documentation_text(obj->documentation()) },
                            { "lines", flac_parse_documentation(obj->documentation()) },
                          }) },
-      { "minalign", json::number_integer_t(obj->minalign()) },
+      { "minalign", arena::json::number_integer_t(obj->minalign()) },
       { "declaration_file", obj->declaration_file()->str() },
       { "fields",
         [&]() {
-          auto fields = json::array({});
+          auto fields = arena::json::array({});
 
           auto list = obj->fields();
           if (list == nullptr) {
@@ -260,25 +296,25 @@ optional<string> flatc_reflection(const path &file) {
           for (int i = 0; i < list->size(); i++) {
             auto entry = list->Get(i);
             fields.push_back({
-              { "id", json::number_integer_t(entry->id()) },
-              { "name", json::string_t(entry->name()->str()) },
+              { "id", arena::json::number_integer_t(entry->id()) },
+              { "name", arena::json::string_t(entry->name()->str()) },
               { "type", type_info(entry->type()) },
               { "attributes", flac_parse_attributes(entry->attributes()) },
-              { "documentation", json({
+              { "documentation", arena::json({
                                    { "text", flac_parse_documentation_text(entry->documentation()) },
                                    { "lines", flac_parse_documentation(entry->documentation()) },
                                  }) },
-              { "offset", json::number_integer_t(entry->offset()) },
-              { "padding", json::number_integer_t(entry->padding()) },
+              { "offset", arena::json::number_integer_t(entry->offset()) },
+              { "padding", arena::json::number_integer_t(entry->padding()) },
 
-              { "key", json::boolean_t(entry->key()) },
-              { "deprecated", json::boolean_t(entry->deprecated()) },
-              { "optional", json::boolean_t(entry->optional()) },
-              { "required", json::boolean_t(entry->required()) },
-              { "offset64", json::boolean_t(entry->offset64()) },
+              { "key", arena::json::boolean_t(entry->key()) },
+              { "deprecated", arena::json::boolean_t(entry->deprecated()) },
+              { "optional", arena::json::boolean_t(entry->optional()) },
+              { "required", arena::json::boolean_t(entry->required()) },
+              { "offset64", arena::json::boolean_t(entry->offset64()) },
 
-              { "default_integer", json::number_integer_t(entry->default_integer()) },
-              { "default_float", json::number_integer_t(entry->default_real()) },
+              { "default_integer", arena::json::number_integer_t(entry->default_integer()) },
+              { "default_float", arena::json::number_integer_t(entry->default_real()) },
             });
           }
 
@@ -287,10 +323,10 @@ optional<string> flatc_reflection(const path &file) {
     });
 
     if (obj->is_struct()) {
-      type["bytesize"] = json::number_integer_t(obj->bytesize());
-      data["structs"].push_back(type);
+      type["bytesize"] = arena::json::number_integer_t(obj->bytesize());
+      data["structs"].push_back(move(type));
     } else {
-      data["tables"].push_back(type);
+      data["tables"].push_back(move(type));
     }
   }
 
@@ -321,25 +357,25 @@ optional<string> flatc_reflection(const path &file) {
       }
     }
 
-    auto type = json({
-      { "id", json::number_integer_t(entt::hashed_string::value(name.c_str())) },
+    auto type = arena::json({
+      { "id", arena::json::number_integer_t(entt::hashed_string::value(name.c_str())) },
       { "name", name.substr(name.find_last_of('.') + 1) },
       { "namespace", name.substr(0, name.find_last_of('.')) },
       { "type", type_info(en->underlying_type()) },
       { "attributes", flac_parse_attributes(en->attributes()) },
-      { "documentation", json({
+      { "documentation", arena::json({
                            { "text", flac_parse_documentation_text(en->documentation()) },
                            { "lines", flac_parse_documentation(en->documentation()) },
                          }) },
-      { "min", json(nullptr) },
-      { "max", json(nullptr) },
-      { "range", json(nullptr) },
-      { "count", json(0) },
+      { "min", arena::json(nullptr) },
+      { "max", arena::json(nullptr) },
+      { "range", arena::json(nullptr) },
+      { "count", arena::json(0) },
       { "is_union", en->is_union() },
       { "declaration_file", en->declaration_file()->str() },
       { "values",
         [&]() {
-          auto values = json::array({});
+          auto values = arena::json::array({});
           auto list = en->values();
           if (list == nullptr) {
             return values;
@@ -350,9 +386,9 @@ optional<string> flatc_reflection(const path &file) {
             auto value = entry->value();
             values.push_back({
               { "name", entry->name()->str() },
-              { "value", json::number_integer_t(value) },
+              { "value", arena::json::number_integer_t(value) },
               { "attributes", flac_parse_attributes(entry->attributes()) },
-              { "documentation", json({
+              { "documentation", arena::json({
                                    { "text", flac_parse_documentation_text(entry->documentation()) },
                                    { "lines", flac_parse_documentation(entry->documentation()) },
                                  }) },
@@ -364,14 +400,14 @@ optional<string> flatc_reflection(const path &file) {
     });
 
     if (has_values) {
-      type["min"] = json::number_integer_t(min_value);
-      type["max"] = json::number_integer_t(max_value);
-      type["range"] = json::number_integer_t(max_value - min_value);
+      type["min"] = arena::json::number_integer_t(min_value);
+      type["max"] = arena::json::number_integer_t(max_value);
+      type["range"] = arena::json::number_integer_t(max_value - min_value);
     }
 
-    type["count"] = json::number_integer_t(count);
+    type["count"] = arena::json::number_integer_t(count);
 
-    data["enums"].push_back(type);
+    data["enums"].push_back(move(type));
   }
 
   // Files
@@ -381,11 +417,11 @@ optional<string> flatc_reflection(const path &file) {
       continue;
     }
 
-    auto file = json({
-      { "path", json::string_t(f->filename()->str()) },
+    auto file = arena::json({
+      { "path", arena::json::string_t(f->filename()->str()) },
       { "includes",
         [&]() {
-          auto includes = json::array({});
+          auto includes = arena::json::array({});
 
           auto list = f->included_filenames();
           if (list == nullptr) {
@@ -394,7 +430,7 @@ optional<string> flatc_reflection(const path &file) {
 
           for (int i = 0; i < list->size(); i++) {
             auto entry = list->Get(i);
-            includes.push_back(json::string_t(entry->str()));
+            includes.push_back(arena::json::string_t(entry->str()));
           }
 
           return includes;
@@ -402,10 +438,254 @@ optional<string> flatc_reflection(const path &file) {
 
     });
 
-    data["files"].push_back(file);
+    data["files"].push_back(move(file));
+  }
+
+  auto dump = trace::span("reflect", "json dump");
+  auto text = arena::dump(data, 2);
+  dump.arg("bytes", static_cast<int64_t>(text.size()));
+  return text;
+}
+
+// Every schema `file` pulls in through `include "...";`, itself first. Names
+// are looked up like flatc does (the root schema's directory, then the -I
+// paths), falling back to the including file's own directory.
+vector<path> schema_closure(const path &file, const vector<string> &includes) {
+  auto directories = vector<path>{ file.parent_path() };
+  directories.insert(directories.end(), includes.begin(), includes.end());
+
+  auto closure = vector<path>{};
+  auto seen = set<string>{};
+  auto pending = vector<path>{ file };
+
+  while (!pending.empty()) {
+    auto current = pending.back();
+    pending.pop_back();
+    if (!seen.insert(current.lexically_normal().generic_string()).second) {
+      continue;
+    }
+    closure.push_back(current);
+
+    auto source = io::map_file(current);
+    if (!source.has_value()) {
+      continue;
+    }
+
+    for (auto line : str::split(source->view(), '\n')) {
+      line = str::trim_view(line);
+      if (!str::starts_with(line, "include ") && !str::starts_with(line, "include\"")) {
+        continue;
+      }
+
+      auto open = line.find('"');
+      auto close = line.find('"', open + 1);
+      if (close == string_view::npos) {
+        continue;
+      }
+
+      auto name = path(line.substr(open + 1, close - open - 1));
+      auto candidates = directories;
+      candidates.push_back(current.parent_path());
+      for (auto &directory : candidates) {
+        if (filesystem::exists(directory / name)) {
+          pending.push_back(filesystem::absolute(directory / name));
+          break;
+        }
+      }
+    }
+  }
+
+  return closure;
+}
+
+optional<string> flatc_reflection(const path &file, const vector<string> &includes) {
+  auto traced = trace::span("reflect", "flatc");
+  traced.arg("file", file.string());
+
+  // tmpnam's own buffer isn't thread safe, parallel_map workers get here too
+  char name[L_tmpnam];
+  string location = std::tmpnam(name);
+  filesystem::create_directories(location);
+
+  auto bfbs = path(location) / path(file).filename().replace_extension(".bfbs");
+
+  auto arguments = vector<string>{
+    "--binary", "--bfbs-gen-embed", "--bfbs-comments", "--bfbs-builtins",
+    "-o",       location.c_str(),
+  };
+  for (auto &include : includes) {
+    arguments.push_back("-I");
+    arguments.push_back(include);
+  }
+  arguments.push_back("--schema");
+  arguments.push_back(file.string());
+
+  auto status = flatc(io::get_current_executable_directory(), arguments);
+  if (status != 0) {
+    return {};
+  }
+
+  auto result = optional<string>{};
+  {
+    auto buffer = io::map_file(bfbs);
+    if (buffer.has_value()) {
+      result = schema_reflection(*reflection::GetSchema(buffer->data()));
+    }
+  }
+  deps::forget(bfbs);
+
+  error_code ec;
+  filesystem::remove_all(location, ec);
+
+  return result;
+}
+
+optional<string> parser_reflection(const path &file, const vector<string> &includes) {
+  auto traced = trace::span("reflect", "parse");
+  traced.arg("file", file.string());
+
+  auto [exists, source] = io::read_file(file);
+  if (!exists) {
+    spdlog::error("Unable to read schema: {}", file.string());
+    return {};
+  }
+
+  flatbuffers::IDLOptions opts;
+  opts.binary_schema_comments = true;
+  opts.binary_schema_builtins = true;
+
+  // same lookup order as flatc: the schema's own directory, then -I paths
+  auto directories = vector<string>{ file.parent_path().string() };
+  directories.insert(directories.end(), includes.begin(), includes.end());
+
+  auto include_paths = vector<const char *>{};
+  for (auto &directory : directories) {
+    include_paths.push_back(directory.c_str());
+  }
+  include_paths.push_back(nullptr);
+
+  flatbuffers::Parser parser(opts);
+  if (!parser.Parse(source.c_str(), include_paths.data(), file.string().c_str())) {
+    spdlog::error("Unable to parse schema: {}", parser.error_);
+    return {};
+  }
+
+  parser.Serialize();
+  return schema_reflection(*reflection::GetSchema(parser.builder_.GetBufferPointer()));
+}
+
+// Reflection results survive between watch mode runs and are reused as long
+// as no file of the schema's include closure changed.
+optional<string> cached_reflection(const path &file, const vector<string> &includes, bool in_process) {
+  struct entry {
+    vector<pair<path, optional<hash_cache::file_stat>>> files;
+    string data;
+  };
+  static auto cache = unordered_map<string, entry>{};
+  // parallel_map workers reflect too: the lock only guards the cache, a
+  // schema being reflected by one of them makes the others wait for it
+  static auto lock = mutex{};
+  static auto reflected = condition_variable{};
+  static auto pending = unordered_set<string>{};
+
+  auto traced = trace::span("reflect", "reflect");
+  traced.arg("file", file.string());
+  stats::add(stats::counter::reflect_calls);
+
+  auto key = string(in_process ? "parser" : "flatc") + '\n' + file.generic_string();
+  for (auto &include : includes) {
+    key += '\n' + include;
+  }
+
+  {
+    auto guard = unique_lock(lock);
+    reflected.wait(guard, [&]() {
+      return !pending.contains(key);
+    });
+
+    auto found = cache.find(key);
+    if (found != cache.end()) {
+      auto fresh = all_of(found->second.files.begin(), found->second.files.end(), [](auto &current) {
+        return hash_cache::stat(current.first) == current.second;
+      });
+      if (fresh) {
+        auto hit = found->second;
+        guard.unlock();
+        for (auto &current : hit.files) {
+          if (current.second.has_value()) {
+            deps::read(current.first);
+          }
+        }
+        traced.arg("cached", 1);
+        stats::add(stats::counter::reflect_cache_hits);
+        return hit.data;
+      }
+      cache.erase(found);
+    }
+    pending.insert(key);
+  }
+
+  auto done = [&](optional<entry> result) {
+    {
+      auto guard = lock_guard(lock);
+      if (result.has_value()) {
+        cache[key] = move(result.value());
+      }
+      pending.erase(key);
+    }
+    reflected.notify_all();
+  };
+
+  auto files = vector<pair<path, optional<hash_cache::file_stat>>>{};
+  auto started = chrono::steady_clock::time_point{};
+  auto result = optional<string>{};
+  try {
+    for (auto &schema : schema_closure(file, includes)) {
+      files.emplace_back(schema, hash_cache::stat(schema));
+    }
+    started = chrono::steady_clock::now();
+    result = in_process ? parser_reflection(file, includes) : flatc_reflection(file, includes);
+  } catch (...) {
+    done({});
+    throw;
   }
+  auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started);
+  stats::add(stats::counter::reflect_us, static_cast<uint64_t>(elapsed.count()));
 
-  return data.dump(2);
+  if (result.has_value()) {
+    done(entry{ .files = move(files), .data = result.value() });
+  } else {
+    done({});
+  }
+  return result;
+}
+
+// A single string or a list of them.
+vector<string> string_list(const sol::object &value) {
+  if (value.is<string>()) {
+    return vector<string>{ value.as<string>() };
+  }
+  return value.is<sol::table>() ? value.as<vector<string>>() : vector<string>{};
+}
+
+// What a task's `run` returned: nothing or true, false, a job or a list of jobs.
+tasks::outcome task_outcome(const sol::object &value) {
+  if (value.is<bool>()) {
+    return tasks::outcome{ .ok = value.as<bool>() };
+  }
+  if (value.is<shared_ptr<process::job>>()) {
+    return tasks::outcome{ .jobs = { value.as<shared_ptr<process::job>>() } };
+  }
+
+  auto result = tasks::outcome{};
+  if (value.is<sol::table>()) {
+    for (auto &[key, entry] : value.as<sol::table>()) {
+      if (entry.is<shared_ptr<process::job>>()) {
+        result.jobs.push_back(entry.as<shared_ptr<process::job>>());
+      }
+    }
+  }
+  return result;
 }
 
 auto on_script_error(lua_State *, sol::protected_function_result pfr) {
@@ -414,48 +694,266 @@ auto on_script_error(lua_State *, sol::protected_function_result pfr) {
   return pfr;
 }
 
-int run_project(const path &entrypoint, const vector<string> &arguments) {
-  auto project_file = path(entrypoint);
+// Startup phases reported by `--timings`, each measured from the previous mark.
+struct startup_timer {
+  using clock = chrono::steady_clock;
 
-  if (filesystem::is_directory(project_file)) {
-    project_file /= "flatt.lua";
+  bool enabled = false;
+  clock::time_point last = clock::now();
+  vector<pair<string_view, clock::duration>> phases;
+
+  // namespaces registered on first use while the script runs, also by
+  // parallel_map workers
+  atomic<clock::rep> lazy = 0;
+  atomic<int> lazy_count = 0;
+
+  void mark(string_view phase) {
+    auto now = clock::now();
+    phases.emplace_back(phase, now - last);
+    last = now;
   }
 
-  if (!filesystem::exists(project_file)) {
-    spdlog::error("Unable to find project file: {}", project_file.string());
-    return 1;
+  void report() {
+    auto ms = [](clock::duration elapsed) {
+      return chrono::duration<double, milli>(elapsed).count();
+    };
+
+    if (enabled) {
+      auto total = clock::duration{};
+      spdlog::info("Startup timings:");
+      for (auto &[phase, elapsed] : phases) {
+        spdlog::info("  {:<14}{:>9.2f} ms", phase, ms(elapsed));
+        total += elapsed;
+      }
+      spdlog::info("  {:<14}{:>9.2f} ms", "total", ms(total));
+      if (lazy_count > 0) {
+        spdlog::info(
+          "  {} namespaces registered on first use took {:.2f} ms of the run", lazy_count.load(),
+          ms(clock::duration(lazy.load())));
+      }
+    }
+
+    phases.clear();
+    lazy = 0;
+    lazy_count = 0;
+    last = clock::now();
   }
+};
 
-  project_file = filesystem::absolute(project_file);
-  auto project_dir = project_file.parent_path();
+startup_timer startup;
 
-#ifdef _WIN32
-  SetCurrentDirectory(project_dir.string().c_str());
-#else
-  chdir(project_dir.string().c_str());
-#endif
+// where `--profile-lua` writes the project state's samples, empty when off
+path lua_profile;
 
+// where `--trace` writes the recorded spans, empty when off
+path trace_output;
 
-  sol::state lua;
-  lua.open_libraries(
-    sol::lib::base, sol::lib::package, sol::lib::coroutine, sol::lib::string, sol::lib::os, sol::lib::math,
-    sol::lib::table, sol::lib::debug, sol::lib::bit32, sol::lib::io, sol::lib::ffi, sol::lib::jit, sol::lib::utf8);
+// `--stats` logs the run's counters, `--stats-json` writes them as JSON
+bool log_stats = false;
+path stats_output;
 
+// `--lua-gc` and `--lua-memory`: the project state's collector mode and its
+// memory limit in bytes (0 = none)
+string lua_gc_mode = "incremental";
+size_t lua_memory_limit = 0;
 
-  // variables
+// what the project state of the current run allocates from
+lua_alloc::allocator *lua_memory = nullptr;
 
-  lua["flatt"] = lua.create_table();
-  lua["flatt"]["executable_dir"] = io::get_current_executable_directory().string();
-  lua["flatt"]["project_dir"] = project_dir.string();
-  lua["flatt"]["argv"] = arguments;
+// The counters of the current run, then the output cache's (which span the
+// process) and the peak RSS.
+vector<pair<string, uint64_t>> run_stats() {
+  auto result = vector<pair<string, uint64_t>>{};
+  for (auto &[name, value] : stats::snapshot()) {
+    result.emplace_back(name, value);
+  }
+  auto cached = output_cache::counters();
+  result.emplace_back("output_cache_hits", cached.hits);
+  result.emplace_back("output_cache_misses", cached.misses);
+  result.emplace_back("output_cache_stored", cached.stored);
+  if (lua_memory != nullptr) {
+    auto &memory = lua_memory->counters();
+    result.emplace_back("lua_bytes", memory.bytes);
+    result.emplace_back("lua_peak_bytes", memory.peak);
+    result.emplace_back("lua_allocations", memory.allocations);
+    result.emplace_back("lua_pooled", memory.pooled);
+    result.emplace_back("lua_reserved", memory.reserved);
+    result.emplace_back("lua_refused", memory.refused);
+  }
+  result.emplace_back("peak_rss", stats::peak_rss());
+  return result;
+}
+
+void report_stats() {
+  auto counters = run_stats();
+  if (log_stats) {
+    spdlog::info("Stats:");
+    for (auto &[name, value] : counters) {
+      spdlog::info("  {} {}", str::padright(name, 20), value);
+    }
+  }
+
+  if (!stats_output.empty()) {
+    auto document = nlohmann::ordered_json::object();
+    for (auto &[name, value] : counters) {
+      document[name] = value;
+    }
+    ofstream ofs(stats_output, ios::binary | ios::trunc);
+    ofs << document.dump(2) << '\n';
+    if (!ofs) {
+      spdlog::error("Unable to write stats: {}", stats_output.string());
+    }
+  }
+}
+
+using loader = function<void(sol::state_view)>;
+
+// Defers registering names of `target` until a script first reads one of
+// them: an __index metamethod runs the loader for that name, which defines it
+// (and the other names it shares the loader with) for good. Names no loader
+// covers stay nil.
+void register_lazily(sol::state_view lua, sol::table target, vector<pair<vector<string>, loader>> loaders) {
+  auto pending = make_shared<unordered_map<string, shared_ptr<loader>>>();
+  for (auto &[names, load] : loaders) {
+    auto shared = make_shared<loader>(move(load));
+    for (auto &name : names) {
+      (*pending)[name] = shared;
+    }
+  }
+
+  auto meta = lua.create_table();
+  meta["__index"] = [pending](sol::this_state state, const sol::table &self, const sol::object &key) {
+    auto found = key.get_type() == sol::type::string ? pending->find(key.as<string>()) : pending->end();
+    if (found == pending->end()) {
+      return sol::make_object(state, sol::lua_nil);
+    }
 
-  // logs
+    auto load = found->second;
+    erase_if(*pending, [&](const auto &entry) {
+      return entry.second == load;
+    });
+
+    auto started = startup_timer::clock::now();
+    (*load)(sol::state_view(state));
+    startup.lazy += (startup_timer::clock::now() - started).count();
+    startup.lazy_count++;
+
+    return self.raw_get<sol::object>(key);
+  };
+  target[sol::metatable_key] = meta;
+}
+
+// The operation usertype, returned by bindings that run in the background
+// for flatt.spawn tasks.
+void register_operations(sol::state_view lua) {
+  if (lua.globals().raw_get<sol::object>("operation").valid()) {
+    return;
+  }
+
+  lua.new_usertype<async::operation>(
+    "operation", sol::no_constructor, "done", &async::operation::done, "wait",
+    [](sol::this_state state, const async::operation &self) {
+      auto values = sol::variadic_results{};
+      for (auto &value : self.wait()) {
+        marshal::push(state, value);
+        values.push_back(sol::stack::pop<sol::object>(state));
+      }
+      return values;
+    });
+}
+
+// Replaces the blocking binding `table[name]` by one that, called from a
+// flatt.spawn task, runs `start` with the same arguments and awaits the
+// operation it returns, so the task yields instead of stalling the others.
+void make_awaitable(sol::state_view lua, sol::table table, const string &name, sol::object start) {
+  auto wrap = lua
+                .load(
+                  R"(
+                    local blocking, start = ...
+                    return function(...)
+                      if flatt.in_task() then
+                        return flatt.await(start(...))
+                      end
+                      return blocking(...)
+                    end
+                  )",
+                  "=awaitable")
+                .get<sol::protected_function>();
+  table[name] = wrap(table.get<sol::object>(name), start).get<sol::object>();
+}
 
+// With --trace, turns calls to `table[name]`, or to the functions it holds
+// when it's a plain table, into "lua" spans. `c_only` leaves functions written
+// in Lua alone.
+void trace_calls(sol::state_view lua, sol::table table, const string &name, bool c_only = false) {
+  if (!trace::enabled()) {
+    return;
+  }
+
+  auto wrap = lua
+                .load(
+                  R"(
+                    local fn, name, now, complete = ...
+                    local function done(start, ...)
+                      complete(name, start)
+                      return ...
+                    end
+                    return function(...)
+                      return done(now(), fn(...))
+                    end
+                  )",
+                  "=traced")
+                .get<sol::protected_function>();
+  auto now = sol::make_object(lua, []() {
+    return static_cast<int64_t>(trace::clock::now().time_since_epoch().count());
+  });
+  auto complete = sol::make_object(lua, [](const string &name, int64_t start) {
+    trace::complete("lua", name, trace::clock::time_point(trace::clock::duration(start)));
+  });
+
+  auto traced = [&](const sol::object &fn, const string &label) {
+    if (fn.get_type() != sol::type::function) {
+      return fn;
+    }
+    if (c_only) {
+      fn.push(lua.lua_state());
+      auto native = lua_iscfunction(lua.lua_state(), -1) != 0;
+      lua_pop(lua.lua_state(), 1);
+      if (!native) {
+        return fn;
+      }
+    }
+    return wrap(fn, label, now, complete).get<sol::object>();
+  };
+
+  auto value = table.raw_get<sol::object>(name);
+  if (value.get_type() == sol::type::function) {
+    table.raw_set(name, traced(value, name));
+    return;
+  }
+
+  // usertypes keep their methods
+  if (value.get_type() != sol::type::table || value.as<sol::table>()[sol::metatable_key].valid()) {
+    return;
+  }
+  auto functions = value.as<sol::table>();
+  auto keys = vector<string>{};
+  for (auto &[key, entry] : functions) {
+    if (key.get_type() == sol::type::string && entry.get_type() == sol::type::function) {
+      keys.push_back(key.as<string>());
+    }
+  }
+  for (auto &key : keys) {
+    functions.raw_set(key, traced(functions.raw_get<sol::object>(key), name + "." + key));
+  }
+}
+
+void register_log(sol::state_view lua) {
   lua["log"] = lua.create_table();
-  lua["log"]["set_level"] = [&](const std::string &value) {
+  lua["log"]["set_level"] = [](const std::string &value) {
     spdlog::set_level(spdlog::level::from_str(value));
   };
-  lua["log"]["get_level"] = [&]() {
+  lua["log"]["get_level"] = []() {
     return spdlog::level::to_string_view(spdlog::get_level());
   };
   lua["log"]["trace"] = [](const std::string &msg) {
@@ -476,165 +974,553 @@ int run_project(const path &entrypoint, const vector<string> &arguments) {
   lua["log"]["critical"] = [](const std::string &msg) {
     spdlog::critical(msg);
   };
+}
 
-  // files
-
+void register_file(sol::state_view lua) {
   lua["file"] = lua.create_table();
   lua["file"]["exists"] = [](const string &file) {
-    return filesystem::exists(file);
+    return output::pending(file) || filesystem::exists(file);
+  };
+  lua["file"]["read"] = [](sol::this_state state, const string &file) {
+    auto mapped = io::map_file(file);
+    return sol::make_object(state, mapped.has_value() ? mapped->view() : ""sv);
   };
-  lua["file"]["read"] = [](const string &file) {
-    auto [success, content] = io::read_file(file);
-    return content;
+  lua["file"]["map"] = [](const string &file) {
+    auto mapped = io::map_file(file);
+    return mapped.has_value() ? make_shared<io::mapped_file>(move(mapped.value())) : nullptr;
   };
-  lua["file"]["write"] = [](const string &file, const string &content) {
-    return io::write_file(file, content);
+  lua["file"]["write"] = [](const string &file, string_view content) {
+    return output::write(file, content);
   };
-  lua["file"]["hash"] = [](const string &file) {
-    return io::hash_file(file);
+  lua["file"]["write_async"] = [](const string &file, const string &content) {
+    output::queue(file, content);
+    return true;
   };
 
-  // dir
+  register_operations(lua);
+  make_awaitable(lua, lua["file"], "read", sol::make_object(lua, [](const string &file) {
+    return async::start([file]() {
+      auto mapped = io::map_file(file);
+      return vector<marshal::value>{ marshal::value{ mapped.has_value() ? string(mapped->view()) : string() } };
+    });
+  }));
+  make_awaitable(lua, lua["file"], "write", sol::make_object(lua, [](const string &file, string content) {
+    return async::start([file, content = move(content)]() {
+      return vector<marshal::value>{ marshal::value{ output::write(file, content) } };
+    });
+  }));
+  lua["file"]["flush"] = []() {
+    return output::flush();
+  };
+  lua["file"]["hash"] = [](const string &file, sol::optional<string_view> name) -> optional<string> {
+    auto algo = hashes::parse_algorithm(name.value_or("sha1"));
+    if (!algo.has_value()) {
+      spdlog::error("Unknown hash algorithm: {}", name.value());
+      return {};
+    }
+    return io::hash_file(file, algo.value());
+  };
+
+  lua.new_usertype<io::mapped_file>(
+    "mapped_file", sol::no_constructor, "size", &io::mapped_file::size, sol::meta_function::length,
+    &io::mapped_file::size, sol::meta_function::to_string, &io::mapped_file::view, "sub",
+    [](const io::mapped_file &self, int64_t i, sol::optional<int64_t> j) {
+      auto size = static_cast<int64_t>(self.size());
+      auto start = i < 0 ? std::max<int64_t>(size + i + 1, 1) : std::max<int64_t>(i, 1);
+      auto end = j.value_or(-1);
+      end = end < 0 ? size + end + 1 : std::min(end, size);
+      if (start > end) {
+        return ""sv;
+      }
+      return self.view().substr(start - 1, end - start + 1);
+    },
+    "find",
+    [](const io::mapped_file &self, string_view needle, sol::optional<int64_t> init)
+      -> tuple<sol::optional<size_t>, sol::optional<size_t>> {
+      auto size = static_cast<int64_t>(self.size());
+      auto from = init.value_or(1);
+      from = from < 0 ? std::max<int64_t>(size + from + 1, 1) : std::max<int64_t>(from, 1);
+      if (from > size + 1) {
+        return {};
+      }
+      auto found = self.view().find(needle, from - 1);
+      if (found == string_view::npos) {
+        return {};
+      }
+      return { found + 1, found + needle.size() };
+    },
+    "lines", [](const shared_ptr<io::mapped_file> &self) {
+      auto offset = make_shared<size_t>(0);
+      return [self, offset]() -> sol::optional<string_view> {
+        auto view = self->view();
+        if (*offset >= view.size()) {
+          return {};
+        }
+        auto next = view.find('\n', *offset);
+        auto end = next == string_view::npos ? view.size() : next;
+        auto line = view.substr(*offset, end - *offset);
+        *offset = next == string_view::npos ? view.size() : next + 1;
+        return line;
+      };
+    });
+}
 
+void register_dir(sol::state_view lua) {
   lua["dir"] = lua.create_table();
-  lua["dir"]["hash"] = [](const std::string &path) {
-    return io::hash_dir(path);
+  lua["dir"]["hash"] = [](const std::string &path, sol::optional<string_view> name) -> optional<string> {
+    auto algo = hashes::parse_algorithm(name.value_or("sha1"));
+    if (!algo.has_value()) {
+      spdlog::error("Unknown hash algorithm: {}", name.value());
+      return {};
+    }
+    return io::hash_dir(path, algo.value());
   };
   lua["dir"]["list_files"] = [](const std::string &path) {
-    auto files = io::list_files(path);
     auto paths = vector<string>{};
-    for (auto file : files) {
-      paths.push_back(file.string());
+    auto it = io::walker(path);
+    for (auto entry = it.next(); entry.has_value(); entry = it.next()) {
+      paths.push_back(move(entry.value()));
     }
-    return sol::as_table(paths);
+    return sol::as_table(move(paths));
   };
 
   lua["dir"]["list_dirs"] = [](const std::string &path) {
-    auto files = io::list_dirs(path);
     auto paths = vector<string>{};
-    for (auto file : files) {
-      paths.push_back(file.string());
+    auto it = io::walker(path, { .files = false, .dirs = true });
+    for (auto entry = it.next(); entry.has_value(); entry = it.next()) {
+      paths.push_back(move(entry.value()));
     }
-    return sol::as_table(paths);
+    return sol::as_table(move(paths));
   };
 
-  // string
+  lua["dir"]["walk"] = [](const std::string &path, sol::optional<sol::table> options) {
+    auto opts = io::walk_options{};
+    auto concurrent = false;
+    if (options.has_value()) {
+      opts.include = string_list(options->get<sol::object>("glob"));
+      opts.exclude = string_list(options->get<sol::object>("exclude"));
+      opts.max_depth = options->get_or("max_depth", -1);
+      opts.files = options->get_or("files", true);
+      opts.dirs = options->get_or("dirs", false);
+      concurrent = options->get_or("parallel", false);
+    }
+
+    if (concurrent) {
+      auto entries = make_shared<vector<string>>(io::walk_parallel(path, opts));
+      auto index = make_shared<size_t>(0);
+      return function<optional<string>()>([entries, index]() -> optional<string> {
+        if (*index >= entries->size()) {
+          return {};
+        }
+        return move(entries->at((*index)++));
+      });
+    }
+
+    auto it = make_shared<io::walker>(path, move(opts));
+    return function<optional<string>()>([it]() {
+      return it->next();
+    });
+  };
+}
 
-  // lua["string"] = lua.create_table();
+// Extensions of the standard string table, usable as methods on strings.
+const vector<string> string_extensions = {
+  "pad_left", "pad_right", "tokenize", "split", "ends_with", "starts_with", "trim", "trim_left", "trim_right",
+  "join", "to_lower", "to_upper", "to_upper_first", "to_lower_first", "to_snake", "to_kebab", "to_pascal",
+  "to_camel", "to_const", "to_train", "to_ada", "to_cobol", "to_dot", "to_path", "to_space", "to_capital",
+  "to_cpp",
+};
+
+void register_string(sol::state_view lua) {
   lua["string"]["pad_left"] = sol::overload(
-    [](const std::string &value, const int length) {
+    [](string_view value, const int length) {
       return str::padleft(value, length, " ");
     },
-    [](const std::string &value, const int length, const std::string &pad) {
+    [](string_view value, const int length, string_view pad) {
       return str::padleft(value, length, pad);
     });
   lua["string"]["pad_right"] = sol::overload(
-    [](const std::string &value, const int length) {
-      return str::padleft(value, length, " ");
+    [](string_view value, const int length) {
+      return str::padright(value, length, " ");
     },
-    [](const std::string &value, const int length, const std::string &pad) {
+    [](string_view value, const int length, string_view pad) {
       return str::padright(value, length, pad);
     });
-  lua["string"]["tokenize"] = [&](const std::string &value) {
+  lua["string"]["tokenize"] = [](string_view value) {
     return sol::as_table(str::tokenize(value));
   };
   lua["string"]["split"] = sol::overload(
-    [&](const std::string &value, const std::string &delimiter) {
+    [](string_view value, string_view delimiter) {
       return sol::as_table(str::split(value, delimiter));
     },
-    [&](const std::string &value, const std::string &delimiter, int limit) {
+    [](string_view value, string_view delimiter, int limit) {
       return sol::as_table(str::split(value, delimiter, limit));
     });
-  lua["string"]["ends_with"] = [](const std::string &value, const std::string &match) {
+  lua["string"]["ends_with"] = [](string_view value, string_view match) {
     return str::ends_with(value, match);
   };
-  lua["string"]["starts_with"] = [](const std::string &value, const std::string &match) {
+  lua["string"]["starts_with"] = [](string_view value, string_view match) {
     return str::starts_with(value, match);
   };
-  lua["string"]["trim"] = [](const std::string &value) {
-    return str::trim_copy(value);
+  lua["string"]["trim"] = [](string_view value) {
+    return str::trim_view(value);
   };
-  lua["string"]["trim_left"] = [](const std::string &value) {
-    return str::trim_left_copy(value);
+  lua["string"]["trim_left"] = [](string_view value) {
+    return str::trim_left_view(value);
   };
-  lua["string"]["trim_right"] = [](const std::string &value) {
-    return str::trim_right_copy(value);
+  lua["string"]["trim_right"] = [](string_view value) {
+    return str::trim_right_view(value);
   };
-  lua["string"]["join"] = [](const sol::as_table_t<vector<string>> &parts, const string &delim = ",") {
-    return str::join(parts.value(), delim);
+  lua["string"]["join"] = [](const sol::as_table_t<vector<string_view>> &parts, sol::optional<string_view> delim) {
+    return str::join(parts.value(), delim.value_or(","));
   };
-  lua["string"]["to_lower"] = [](const string &value) {
+  lua["string"]["to_lower"] = [](string_view value) {
     return str::to_lower(value);
   };
-  lua["string"]["to_upper"] = [](const string &value) {
+  lua["string"]["to_upper"] = [](string_view value) {
     return str::to_upper(value);
   };
-  lua["string"]["to_upper_first"] = [](const string &value) {
+  lua["string"]["to_upper_first"] = [](string_view value) {
     return str::to_upper_first(value);
   };
-  lua["string"]["to_lower_first"] = [](const string &value) {
+  lua["string"]["to_lower_first"] = [](string_view value) {
     return str::to_lower_first(value);
   };
-  lua["string"]["to_snake"] = [](const string &value) {
+  lua["string"]["to_snake"] = [](string_view value) {
     return str::to_snake(value);
   };
-  lua["string"]["to_kebab"] = [](const string &value) {
+  lua["string"]["to_kebab"] = [](string_view value) {
     return str::to_kebab(value);
   };
-  lua["string"]["to_pascal"] = [](const string &value) {
+  lua["string"]["to_pascal"] = [](string_view value) {
     return str::to_pascal(value);
   };
-  lua["string"]["to_camel"] = [](const string &value) {
+  lua["string"]["to_camel"] = [](string_view value) {
     return str::to_camel(value);
   };
-  lua["string"]["to_const"] = [](const string &value) {
+  lua["string"]["to_const"] = [](string_view value) {
     return str::to_const(value);
   };
-  lua["string"]["to_train"] = [](const string &value) {
+  lua["string"]["to_train"] = [](string_view value) {
     return str::to_train(value);
   };
-  lua["string"]["to_ada"] = [](const string &value) {
+  lua["string"]["to_ada"] = [](string_view value) {
     return str::to_ada(value);
   };
-  lua["string"]["to_cobol"] = [](const string &value) {
+  lua["string"]["to_cobol"] = [](string_view value) {
     return str::to_cobol(value);
   };
-  lua["string"]["to_dot"] = [](const string &value) {
+  lua["string"]["to_dot"] = [](string_view value) {
     return str::to_dot(value);
   };
-  lua["string"]["to_path"] = [](const string &value) {
+  lua["string"]["to_path"] = [](string_view value) {
     return str::to_path(value);
   };
-  lua["string"]["to_space"] = [](const string &value) {
+  lua["string"]["to_space"] = [](string_view value) {
     return str::to_space(value);
   };
-  lua["string"]["to_capital"] = [](const string &value) {
+  lua["string"]["to_capital"] = [](string_view value) {
     return str::to_capital(value);
   };
-  lua["string"]["to_cpp"] = [](const string &value) {
+  lua["string"]["to_cpp"] = [](string_view value) {
     return str::to_cpp(value);
   };
+}
 
-  // templates
-
+void register_template(sol::state_view lua) {
   lua["template"] = lua.create_table();
   lua["template"]["render_string"] = [](const string &source, const string &data) {
-    auto engine = templates::engine();
-    return engine.render(source, json::parse(data));
+    return templates::render(source, json::parse(data));
   };
+}
 
-  // functions
+// The job usertype, needed by anything returning a running process.
+void register_jobs(sol::state_view lua) {
+  if (lua.globals().raw_get<sol::object>("job").valid()) {
+    return;
+  }
 
-  lua["exec"] = [](const string &command, const sol::as_table_t<vector<string>> &arguments, const string &path = "") {
-    return io::shell(command, arguments.value(), path);
+  lua.new_usertype<process::job>(
+    "job", sol::no_constructor, "done", &process::job::done, "wait",
+    [](const process::job &self) -> tuple<int, string_view, string_view> {
+      auto &result = self.wait();
+      return { result.status, result.out, result.err };
+    });
+}
+
+void register_exec(sol::state_view lua) {
+  register_jobs(lua);
+
+  lua["exec"] = [](
+                  const string &command, const sol::as_table_t<vector<string>> &arguments, sol::optional<string> path,
+                  sol::optional<sol::table> options) -> tuple<int, optional<string>, optional<string>> {
+    auto opts = process::options{
+      .cwd = path.value_or(""),
+      .capture = options.has_value() && options->get_or("capture", false),
+      .environment = run_environment,
+    };
+    auto result = process::run(command, arguments.value(), opts);
+    if (!opts.capture) {
+      return { result.status, nullopt, nullopt };
+    }
+    return { result.status, move(result.out), move(result.err) };
   };
 
+  lua["exec_async"] = [](
+                        const string &command, const sol::as_table_t<vector<string>> &arguments,
+                        sol::optional<string> path, sol::optional<sol::table> options) {
+    auto opts = process::options{
+      .cwd = path.value_or(""),
+      .capture = !options.has_value() || options->get_or("capture", true),
+      .environment = run_environment,
+    };
+    return process::start(command, arguments.value(), opts);
+  };
+
+  register_operations(lua);
+  make_awaitable(
+    lua, lua.globals(), "exec",
+    sol::make_object(
+      lua, [](
+             const string &command, const sol::as_table_t<vector<string>> &arguments, sol::optional<string> path,
+             sol::optional<sol::table> options) {
+        auto opts = process::options{
+          .cwd = path.value_or(""),
+          .capture = options.has_value() && options->get_or("capture", false),
+          .environment = run_environment,
+        };
+        return async::start([command, arguments = arguments.value(), opts]() {
+          auto result = process::run(command, arguments, opts);
+          auto values = vector<marshal::value>{ marshal::value{ static_cast<lua_Integer>(result.status) } };
+          if (opts.capture) {
+            values.push_back(marshal::value{ move(result.out) });
+            values.push_back(marshal::value{ move(result.err) });
+          }
+          return values;
+        });
+      }));
+}
+
+void register_fb(sol::state_view lua, const path &project_dir) {
+  register_jobs(lua);
+
   lua["fb"] = lua.create_table();
-  lua["fb"]["compile"] = [&](const sol::as_table_t<vector<string>> &arguments) {
+  // flatc reads the schemas named on its command line and what they include
+  auto track_schemas = [project_dir](const vector<string> &arguments) {
+    auto includes = vector<string>{};
+    auto schemas = vector<path>{};
+    for (size_t i = 0; i < arguments.size(); i++) {
+      if (arguments[i] == "-I" && i + 1 < arguments.size()) {
+        includes.push_back(filesystem::absolute(project_dir / arguments[++i]).string());
+      } else if (str::ends_with(arguments[i], ".fbs")) {
+        schemas.push_back(filesystem::absolute(project_dir / arguments[i]));
+      }
+    }
+    for (auto &schema : schemas) {
+      schema_closure(schema, includes);
+    }
+  };
+
+  lua["fb"]["compile"] = [project_dir, track_schemas](const sol::as_table_t<vector<string>> &arguments) {
+    track_schemas(arguments.value());
     return flatc(project_dir, arguments.value());
   };
-  lua["fb"]["reflect"] = [&](const string &schema) -> auto {
-    return flatc_reflection(filesystem::absolute(schema));
+  register_operations(lua);
+  make_awaitable(
+    lua, lua["fb"], "compile",
+    sol::make_object(lua, [project_dir, track_schemas](const sol::as_table_t<vector<string>> &arguments) {
+      track_schemas(arguments.value());
+      return async::start([project_dir, arguments = arguments.value()]() {
+        return vector<marshal::value>{ marshal::value{ static_cast<lua_Integer>(flatc(project_dir, arguments)) } };
+      });
+    }));
+  lua["fb"]["compile_async"] = [project_dir, track_schemas](const sol::as_table_t<vector<string>> &arguments) {
+    track_schemas(arguments.value());
+    return process::start(
+      find_flatc().string(), arguments.value(),
+      { .cwd = project_dir, .capture = true, .environment = run_environment });
+  };
+  lua["fb"]["reflect"] = [](const string &schema, sol::optional<sol::table> options) -> auto {
+    auto includes = vector<string>{};
+    auto in_process = false;
+    if (options.has_value()) {
+      includes = options->get_or<vector<string>>("includes", vector<string>{});
+      in_process = options->get_or("in_process", false);
+    }
+    for (auto &include : includes) {
+      include = filesystem::absolute(include).string();
+    }
+
+    return cached_reflection(filesystem::absolute(schema), includes, in_process);
+  };
+}
+
+// What flatt.parallel_map workers call for each item: the function a module
+// returns, or one sent as bytecode.
+sol::protected_function load_mapper(sol::state &lua, const string &module, const string &chunk) {
+  if (!module.empty()) {
+    auto loaded = lua["require"].get<sol::protected_function>()(module);
+    if (!loaded.valid()) {
+      sol::error err = loaded;
+      throw runtime_error(err.what());
+    }
+    auto mapper = loaded.get<sol::object>();
+    if (mapper.get_type() != sol::type::function) {
+      throw runtime_error(fmt::format("module '{}' doesn't return a function", module));
+    }
+    return mapper.as<sol::protected_function>();
+  }
+
+  auto L = lua.lua_state();
+  if (luaL_loadbufferx(L, chunk.data(), chunk.size(), "=parallel_map", "b") != LUA_OK) {
+    auto message = string(lua_tostring(L, -1));
+    lua_pop(L, 1);
+    throw runtime_error(message);
+  }
+  return sol::stack::pop<sol::protected_function>(L);
+}
+
+// Opens the libraries and bindings shared by the project state and the
+// flatt.parallel_map workers, then runs the prelude.
+void open_state(sol::state &lua, const path &project_dir, const vector<string> &arguments) {
+  // the rest of the standard library opens on first use, see below
+  lua.open_libraries(
+    sol::lib::base, sol::lib::package, sol::lib::string, sol::lib::math, sol::lib::table, sol::lib::ffi,
+    sol::lib::jit);
+
+
+  // variables
+
+  lua["flatt"] = lua.create_table();
+  lua["flatt"]["executable_dir"] = io::get_current_executable_directory().string();
+  lua["flatt"]["project_dir"] = project_dir.string();
+  lua["flatt"]["argv"] = arguments;
+  lua["flatt"]["depend"] = [](const string &file) {
+    deps::read(file);
+  };
+
+  auto bytecode_dir = project_dir / ".flatt" / "bytecode";
+  lua["flatt"]["loadfile"] = [bytecode_dir](sol::this_state state, const string &file) {
+    auto L = state.lua_state();
+    if (bytecode::load_file(L, file, bytecode_dir) != LUA_OK) {
+      auto error = sol::stack::pop<sol::object>(L);
+      return make_tuple(sol::make_object(L, sol::lua_nil), error);
+    }
+    return make_tuple(sol::stack::pop<sol::object>(L), sol::make_object(L, sol::lua_nil));
+  };
+
+  // libraries and namespaces, registered when a script first touches them
+
+  auto open_library = [](sol::lib library) {
+    return [library](sol::state_view lua) {
+      lua.open_libraries(library);
+    };
+  };
+
+  // flatt's own namespaces are traced with --trace
+  auto bindings = [](vector<string> names, loader load) {
+    return make_pair(names, loader([names, load](sol::state_view lua) {
+      load(lua);
+      for (auto &name : names) {
+        trace_calls(lua, lua.globals(), name);
+      }
+    }));
+  };
+
+  register_lazily(
+    lua, lua.globals(),
+    {
+      { { "coroutine" }, open_library(sol::lib::coroutine) },
+      { { "os" },
+        [](sol::state_view lua) {
+          lua.open_libraries(sol::lib::os);
+          // daemon runs see their client's environment
+          if (run_environment.has_value()) {
+            lua["os"]["getenv"] = [](const string &name) {
+              return environment_variable(name);
+            };
+          }
+        } },
+      { { "io" }, open_library(sol::lib::io) },
+      { { "debug" }, open_library(sol::lib::debug) },
+      { { "bit32" }, open_library(sol::lib::bit32) },
+      { { "utf8" }, open_library(sol::lib::utf8) },
+      bindings(
+        { "json" },
+        [](sol::state_view lua) {
+          lua.require("json", lua_json::open);
+        }),
+      bindings({ "log" }, register_log),
+      bindings({ "file", "mapped_file" }, register_file),
+      bindings({ "dir" }, register_dir),
+      bindings({ "template" }, register_template),
+      bindings({ "exec", "exec_async", "job" }, register_exec),
+      bindings(
+        { "fb" },
+        [project_dir](sol::state_view lua) {
+          register_fb(lua, project_dir);
+        }),
+    });
+  register_lazily(lua, lua["string"], { { string_extensions, register_string } });
+
+  // `require` reaches the deferred libraries through their globals; utf8
+  // and bit32 stay missing on runtimes without them
+  for (auto name : { "coroutine", "os", "io", "debug", "utf8", "bit32", "json" }) {
+    lua["package"]["preload"][name] = [name](sol::this_state state) {
+      auto library = sol::state_view(state).globals().get<sol::object>(name);
+      if (library.get_type() == sol::type::lua_nil) {
+        throw runtime_error(fmt::format("module '{}' not found", name));
+      }
+      return library;
+    };
+  }
+
+  auto job_result = [](sol::this_state state, const process::result &result) {
+    return sol::state_view(state).create_table_with(
+      "status", result.status, "stdout", result.out, "stderr", result.err);
+  };
+
+  lua["flatt"]["wait_all"] = [job_result](sol::this_state state, const sol::table &jobs) {
+    auto results = sol::state_view(state).create_table();
+    for (size_t i = 1; i <= jobs.size(); i++) {
+      auto item = jobs.get<sol::object>(i);
+      if (!item.is<shared_ptr<process::job>>()) {
+        throw runtime_error(fmt::format("flatt.wait_all: item {} isn't a job", i));
+      }
+      results[i] = job_result(state, item.as<shared_ptr<process::job>>()->wait());
+    }
+    return results;
+  };
+
+  // blocks until one of the jobs or operations is done, returns its index
+  lua["flatt"]["wait_any"] = [](const sol::table &pending) {
+    auto indices = vector<size_t>{};
+    auto checks = vector<function<bool()>>{};
+    for (size_t i = 1; i <= pending.size(); i++) {
+      auto item = pending.get<sol::object>(i);
+      if (item.is<shared_ptr<process::job>>()) {
+        checks.push_back([job = item.as<shared_ptr<process::job>>()]() {
+          return job->done();
+        });
+      } else if (item.is<shared_ptr<async::operation>>()) {
+        checks.push_back([operation = item.as<shared_ptr<async::operation>>()]() {
+          return operation->done();
+        });
+      } else {
+        continue;
+      }
+      indices.push_back(i);
+    }
+    return checks.empty() ? 0 : indices[async::wait_any(checks)];
+  };
+
+  lua["flatt"]["stats"] = [](sol::this_state state) {
+    auto lua = sol::state_view(state);
+    auto result = lua.create_table();
+    for (auto &[name, value] : run_stats()) {
+      result[name] = static_cast<lua_Integer>(value);
+    }
+    return result;
   };
 
   lua.safe_script(
@@ -649,16 +1535,486 @@ int run_project(const path &entrypoint, const vector<string> &arguments) {
       end
       package.path = package.path .. flatt.project_dir .. "/?.lua"
 
+      -- load Lua modules through the bytecode cache (which also records
+      -- them as inputs of the run) ahead of the stock file searcher
+      do
+        local searchers = package.searchers or package.loaders
+        table.insert(searchers, 2, function(name)
+          local file = package.searchpath(name, package.path)
+          if not file then
+            return nil
+          end
+          local loader, err = flatt.loadfile(file)
+          if not loader then
+            error(string.format("error loading module '%s' from file '%s':\n\t%s", name, file, err), 2)
+          end
+          return loader, file
+        end)
+      end
+
+      -- flatt.spawn/flatt.await: tasks are coroutines yielding what they
+      -- await (another task, or a job or operation with done/wait); the loop
+      -- resumes them once it completed and blocks on flatt.wait_any between
+      do
+        local unpack = table.unpack or unpack
+        local function pack(...)
+          return { n = select("#", ...), ... }
+        end
+
+        local AWAIT = {}
+        local Task = {}
+        Task.__index = Task
+        function Task:done()
+          return self.finished
+        end
+
+        local current = nil
+        local spawned = {}
+        local suspended = {}
+
+        local function ready(awaited)
+          if getmetatable(awaited) == Task then
+            return awaited.finished
+          end
+          return awaited == nil or awaited:done()
+        end
+
+        local function results(awaited)
+          if getmetatable(awaited) == Task then
+            awaited.observed = true
+            if awaited.error ~= nil then
+              error(awaited.error, 0)
+            end
+            return unpack(awaited.results, 1, awaited.results.n)
+          end
+          return awaited:wait()
+        end
+
+        local function resume(task, ...)
+          local previous = current
+          current = task
+          local out = pack(coroutine.resume(task.co, ...))
+          current = previous
+
+          if not out[1] then
+            task.finished, task.error = true, out[2]
+          elseif coroutine.status(task.co) == "dead" then
+            task.finished, task.results = true, pack(unpack(out, 2, out.n))
+          else
+            -- a plain coroutine.yield just waits for the next turn
+            task.awaiting = out[2] == AWAIT and out[3] or nil
+            suspended[#suspended + 1] = task
+          end
+        end
+
+        -- resumes the tasks whose awaited value completed, if any did
+        local function step()
+          local progressed = false
+          local pending = suspended
+          suspended = {}
+          for _, task in ipairs(pending) do
+            local awaited = task.awaiting
+            if ready(awaited) then
+              progressed = true
+              task.awaiting = nil
+              if awaited == nil then
+                resume(task)
+              else
+                resume(task, pcall(results, awaited))
+              end
+            else
+              suspended[#suspended + 1] = task
+            end
+          end
+          return progressed
+        end
+
+        local function block(target)
+          local pending = {}
+          if target ~= nil and getmetatable(target) ~= Task then
+            pending[1] = target
+          end
+          for _, task in ipairs(suspended) do
+            if getmetatable(task.awaiting) ~= Task then
+              pending[#pending + 1] = task.awaiting
+            end
+          end
+          if #pending == 0 then
+            error("flatt.await: every task is waiting on another task", 0)
+          end
+          flatt.wait_any(pending)
+        end
+
+        -- runs tasks until `target` completed, or all of them when nil
+        local function run(target)
+          while target == nil or not ready(target) do
+            if not step() then
+              if target == nil and #suspended == 0 then
+                return
+              end
+              block(target)
+            end
+          end
+        end
+
+        function flatt.spawn(fn, ...)
+          local task = setmetatable({ co = coroutine.create(fn), finished = false }, Task)
+          spawned[#spawned + 1] = task
+          resume(task, ...)
+          return task
+        end
+
+        function flatt.in_task()
+          return current ~= nil and coroutine.running() == current.co
+            and (coroutine.isyieldable == nil or coroutine.isyieldable())
+        end
+
+        function flatt.await(awaited)
+          if awaited == nil then
+            error("flatt.await: nothing to await", 2)
+          end
+          if flatt.in_task() then
+            local out = pack(coroutine.yield(AWAIT, awaited))
+            if not out[1] then
+              error(out[2], 0)
+            end
+            return unpack(out, 2, out.n)
+          end
+          run(awaited)
+          return results(awaited)
+        end
+
+        -- finishes every spawned task, raising the first error nobody awaited
+        function flatt.run()
+          run(nil)
+          local finished = spawned
+          spawned = {}
+          for _, task in ipairs(finished) do
+            if task.error ~= nil and not task.observed then
+              task.observed = true
+              error(task.error, 0)
+            end
+          end
+        end
+      end
+
       -- more
       -- ...
     )",
     on_script_error);
+}
+
+int run_project(const path &entrypoint, const vector<string> &arguments) {
+  auto project_file = path(entrypoint);
+
+  if (filesystem::is_directory(project_file)) {
+    project_file /= "flatt.lua";
+  }
+
+  if (!filesystem::exists(project_file)) {
+    spdlog::error("Unable to find project file: {}", project_file.string());
+    return 1;
+  }
+
+  project_file = filesystem::absolute(project_file);
+  auto project_dir = project_file.parent_path();
+
+  // before changing directories, a relative cache path is relative to the caller
+  auto cache_dir = environment_variable("FLATT_CACHE_DIR").value_or("");
+  output_cache::open(!cache_dir.empty() ? filesystem::absolute(cache_dir) : path());
+
+#ifdef _WIN32
+  SetCurrentDirectory(project_dir.string().c_str());
+#else
+  chdir(project_dir.string().c_str());
+#endif
+
+
+  hash_cache::open(project_dir / ".flatt" / "hashes");
+  startup.mark("project");
+
+#ifdef LUAJIT_VERSION
+  // 64-bit LuaJIT only runs on its own allocator
+  sol::state lua;
+#else
+  sol::state lua(sol::default_at_panic, lua_alloc::allocate, lua_memory);
+#endif
+  if (lua_gc_mode == "generational") {
+#if LUA_VERSION_NUM >= 504
+    lua_gc(lua.lua_state(), LUA_GCGEN, 0, 0);
+#else
+    spdlog::warn("The generational collector needs Lua 5.4, keeping the incremental one");
+#endif
+  }
+  startup.mark("lua state");
+  open_state(lua, project_dir, arguments);
+  startup.mark("libraries");
+
+  auto bytecode_dir = project_dir / ".flatt" / "bytecode";
+
+  // tasks
+
+  auto graph = vector<tasks::task>{};
+  auto built = true;
+  // tasks of earlier flatt.build() calls, which later ones don't run again
+  auto finished = unordered_map<string, bool>{};
+
+  auto build_tasks = [&]() {
+    built = true;
+
+    // tasks are only up to date, locally or in the output cache, for the
+    // same flatt version and Lua sources: the script and every module loaded
+    // so far, where `run` functions may come from
+    auto salt = string(FLATT_VERSION "\n");
+    for (auto &[name, digest] : bytecode::sources()) {
+      salt += name + ' ' + digest + '\n';
+    }
+    return tasks::build(graph, project_dir / ".flatt" / "tasks", finished, salt);
+  };
+
+  lua["flatt"]["task"] = [&](const sol::table &spec) {
+    auto task = tasks::task{
+      .name = spec.get_or<string>("name", ""),
+      .inputs = string_list(spec.get<sol::object>("inputs")),
+      .outputs = string_list(spec.get<sol::object>("outputs")),
+      .deps = string_list(spec.get<sol::object>("deps")),
+      .version = spec.get_or<string>("version", ""),
+      .command = string_list(spec.get<sol::object>("command")),
+    };
+    if (task.name.empty()) {
+      spdlog::error("flatt.task needs a name");
+      return false;
+    }
+
+    auto run = spec.get<sol::optional<sol::protected_function>>("run");
+    if (run.has_value()) {
+      task.run = [&lua, run = run.value()](const tasks::task &self, const vector<string> &inputs) mutable {
+        auto info = lua.create_table_with(
+          "name", self.name, "inputs", sol::as_table(inputs), "outputs", sol::as_table(self.outputs));
+        auto result = run(info);
+        if (!result.valid()) {
+          sol::error err = result;
+          spdlog::error("task {} failed: {}", self.name, err.what());
+          return tasks::outcome{ .ok = false };
+        }
+        return result.return_count() == 0 ? tasks::outcome{} : task_outcome(result.get<sol::object>());
+      };
+    } else if (!task.command.empty()) {
+      task.run = [&project_dir](const tasks::task &self, const vector<string> &) {
+        auto &command = self.command;
+        auto args = vector<string>(command.begin() + 1, command.end());
+        auto opts = process::options{ .cwd = project_dir, .capture = true, .environment = run_environment };
+        return tasks::outcome{ .jobs = { process::start(command[0], args, opts) } };
+      };
+    }
+
+    graph.push_back(move(task));
+    built = false;
+    return true;
+  };
 
-  auto result = lua.safe_script_file(project_file.string(), on_script_error);
+  lua["flatt"]["build"] = [&](sol::this_state state) {
+    auto result = build_tasks();
+    auto stats = sol::state_view(state).create_table();
+    if (result.has_value()) {
+      stats["ran"] = result->ran;
+      stats["skipped"] = result->skipped;
+      stats["restored"] = result->restored;
+      stats["failed"] = result->failed;
+    }
+    return make_tuple(result.has_value() && result->failed == 0, stats);
+  };
+
+  // parallel map
+
+  // one state per worker thread, created on first use and kept for the run
+  auto workers = vector<unique_ptr<sol::state>>{};
+
+  lua["flatt"]["parallel_map"] = [&](
+                                   sol::this_state state, const sol::table &items, const sol::object &mapper,
+                                   sol::optional<sol::table> options) {
+    auto L = state.lua_state();
+    auto fail = [L](const string &message) {
+      return make_tuple(sol::make_object(L, sol::lua_nil), sol::make_object(L, "flatt.parallel_map: " + message));
+    };
+
+    // workers run a module returning the mapper, or get the function as
+    // bytecode, which leaves its upvalues behind
+    auto module = string();
+    auto chunk = string();
+    if (mapper.get_type() == sol::type::string) {
+      module = mapper.as<string>();
+    } else if (mapper.get_type() == sol::type::function) {
+      mapper.push(L);
+      // C closures report their upvalues without names
+      if (lua_iscfunction(L, -1)) {
+        lua_pop(L, 1);
+        return fail("C functions can't be sent to workers");
+      }
+      for (int i = 1; auto name = lua_getupvalue(L, -1, i); i++) {
+        auto upvalue = string(name);
+        lua_pop(L, 1);
+        if (upvalue != "_ENV") {
+          lua_pop(L, 1);
+          return fail(fmt::format("the function uses '{}' from an enclosing scope, workers only share globals", upvalue));
+        }
+      }
+      chunk = bytecode::dump(L);
+      lua_pop(L, 1);
+      if (chunk.empty()) {
+        return fail("the function can't be dumped to send it to workers");
+      }
+    } else {
+      return fail("expected a function or a module name");
+    }
+
+    auto count = items.size();
+    auto inputs = vector<marshal::value>{};
+    inputs.reserve(count);
+    items.push(L);
+    for (size_t i = 1; i <= count; i++) {
+      auto error = string();
+      lua_rawgeti(L, -1, static_cast<lua_Integer>(i));
+      auto input = marshal::capture(L, -1, error);
+      lua_pop(L, 1);
+      if (!input.has_value()) {
+        lua_pop(L, 1);
+        return fail(fmt::format("item {}: {}", i, error));
+      }
+      inputs.push_back(move(input.value()));
+    }
+    lua_pop(L, 1);
+
+    auto threads = options.has_value() ? options->get_or<size_t>("workers", 0) : 0;
+    threads = std::min(threads == 0 ? parallel::concurrency() : threads, std::max<size_t>(count, 1));
+    if (workers.size() < threads) {
+      workers.resize(threads);
+    }
+
+    auto functions = vector<sol::protected_function>(threads);
+    auto outputs = vector<marshal::value>(count);
+    try {
+      parallel::for_each_worker(
+        count,
+        [&](size_t worker, size_t index) {
+          auto &lua = workers[worker];
+          if (!lua) {
+            lua = make_unique<sol::state>();
+            open_state(*lua, project_dir, arguments);
+          }
+          auto &function = functions[worker];
+          if (!function.valid()) {
+            function = load_mapper(*lua, module, chunk);
+          }
+
+          auto W = lua->lua_state();
+          marshal::push(W, inputs[index]);
+          auto item = sol::stack::pop<sol::object>(W);
+          auto result = function(item, index + 1);
+          if (!result.valid()) {
+            sol::error err = result;
+            throw runtime_error(fmt::format("item {}: {}", index + 1, err.what()));
+          }
+          if (result.return_count() == 0) {
+            return;
+          }
+
+          auto error = string();
+          auto output = marshal::capture(W, result.stack_index(), error);
+          if (!output.has_value()) {
+            throw runtime_error(fmt::format("result {}: {}", index + 1, error));
+          }
+          outputs[index] = move(output.value());
+        },
+        threads);
+    } catch (const exception &err) {
+      return fail(err.what());
+    }
+
+    auto results = sol::state_view(L).create_table(static_cast<int>(count), 0);
+    results.push(L);
+    for (size_t i = 0; i < count; i++) {
+      marshal::push(L, outputs[i]);
+      lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+    }
+    lua_pop(L, 1);
+    return make_tuple(sol::object(results), sol::make_object(L, sol::lua_nil));
+  };
+
+  trace_calls(lua, lua.globals(), "flatt", true);
+
+
+  auto run_script = [&]() {
+    auto L = lua.lua_state();
+    if (bytecode::load_file(L, project_file, bytecode_dir) != LUA_OK) {
+      // the message stays on the stack, where a failed call leaves its error
+      return sol::protected_function_result(L, lua_gettop(L), 1, 1, sol::call_status::file);
+    }
+    startup.mark("script load");
+    auto chunk = sol::stack::pop<sol::protected_function>(L);
+    auto result = chunk();
+    startup.mark("script run");
+    return result;
+  };
+
+  if (!lua_profile.empty()) {
+    profiler::start(lua.lua_state());
+  }
+
+  auto result = run_script();
   if (!result.valid()) {
+    result = on_script_error(lua.lua_state(), move(result));
+  }
+
+  // coroutines spawned by the script finish before anything is built
+  auto spawned_ok = true;
+  if (result.valid()) {
+    auto drained = lua["flatt"]["run"].get<sol::protected_function>()();
+    if (!drained.valid()) {
+      on_script_error(lua.lua_state(), move(drained));
+      spawned_ok = false;
+    }
+  }
+
+  // tasks declared but never built run once the script is done
+  auto tasks_ok = true;
+  if (result.valid() && spawned_ok && !built) {
+    auto summary = build_tasks();
+    tasks_ok = summary.has_value() && summary->failed == 0;
+    startup.mark("tasks");
+  }
+
+  if (!lua_profile.empty()) {
+    profiler::stop(lua.lua_state());
+    if (!profiler::write(lua_profile)) {
+      spdlog::error("Unable to write Lua profile: {}", lua_profile.string());
+    }
+    profiler::summary();
+  }
+
+  if (!output::flush()) {
+    spdlog::error("Unable to write some of the generated files");
+  }
+
+  if (!hash_cache::save()) {
+    spdlog::warn("Unable to save the hash cache");
+  }
+  startup.mark("flush");
+  startup.report();
+
+  if (output_cache::enabled()) {
+    auto counters = output_cache::counters();
+    spdlog::info("Output cache: {} hits, {} misses, {} stored", counters.hits, counters.misses, counters.stored);
+  }
+
+  if (!result.valid() || !spawned_ok) {
     return -1;
   }
 
+  if (!tasks_ok) {
+    return 1;
+  }
+
   if (result.get_type() == sol::type::number) {
     return result.get<int>();
   }
@@ -666,15 +2022,70 @@ int run_project(const path &entrypoint, const vector<string> &arguments) {
   return 0;
 }
 
-int main(int argc, const char *argv[]) {
-  auto console = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
+// Runs the project from a clean dependency record, then writes the
+// requested depfile (targeting the manifest when there is one, else every
+// generated file) and outputs manifest.
+int run_tracked(const path &project, const vector<string> &arguments, const string &depfile, const string &manifest) {
+  deps::reset();
+  stats::reset();
+  bytecode::reset();
+
+  // outlives the project state, which returns every block before closing
+  auto memory = lua_alloc::allocator(lua_memory_limit);
+#ifndef LUAJIT_VERSION
+  lua_memory = &memory;
+#endif
+
+  auto status = 0;
+  {
+    auto traced = trace::span("flatt", "run");
+    traced.arg("project", project.string());
+    status = run_project(project, arguments);
+  }
+
+  if (memory.counters().refused > 0) {
+    spdlog::error("The script ran into the Lua memory limit of {} MiB", lua_memory_limit / (1024 * 1024));
+  }
+
+  if (!manifest.empty() && !deps::write_manifest(manifest)) {
+    spdlog::error("Unable to write outputs manifest: {}", manifest);
+  }
+
+  if (!depfile.empty()) {
+    auto targets = manifest.empty() ? deps::outputs() : vector<string>{ manifest };
+    if (targets.empty()) {
+      targets.push_back(depfile);
+    }
+    if (!deps::write_depfile(depfile, targets)) {
+      spdlog::error("Unable to write depfile: {}", depfile);
+    }
+  }
+
+  // rewritten after every run in watch mode, spans keep accumulating
+  if (!trace_output.empty() && !trace::write(trace_output)) {
+    spdlog::error("Unable to write trace: {}", trace_output.string());
+  }
+
+  if (log_stats || !stats_output.empty()) {
+    report_stats();
+  }
+
+  lua_memory = nullptr;
+  return status;
+}
+
+// Logs to stdout, with the banner and colors unless `plain`.
+void setup_console(bool plain) {
+  auto console = plain ? spdlog::sink_ptr(std::make_shared<spdlog::sinks::stdout_sink_mt>())
+                       : spdlog::sink_ptr(std::make_shared<spdlog::sinks::stdout_color_sink_mt>());
   auto logger = std::make_shared<spdlog::logger>("console", console);
   logger->set_level(spdlog::level::trace);
 
   spdlog::set_default_logger(logger);
-  spdlog::set_pattern("%^%v%$");
-  spdlog::info("");
-  spdlog::info(R"(
+  if (!plain) {
+    spdlog::set_pattern("%^%v%$");
+    spdlog::info("");
+    spdlog::info(R"(
    __ _       _   _     _
   / _| | __ _| |_| |_  | |_   _  __ _
  | |_| |/ _` | __| __| | | | | |/ _` |
@@ -682,23 +2093,184 @@ int main(int argc, const char *argv[]) {
  |_| |_|\__,_|\__|\__(_)_|\__,_|\__,_|
 
 )");
+  }
 
-  spdlog::set_pattern(" %^%v%$");
+  spdlog::set_pattern(plain ? "%v" : " %^%v%$");
 #ifdef _DEBUG
   spdlog::set_level(spdlog::level::trace);
 #else
   spdlog::set_level(spdlog::level::info);
 #endif
+}
+
+int main(int argc, const char *argv[]) {
+  auto command = argc > 1 ? std::string_view(argv[1]) : std::string_view();
+
+  if (command == "serve") {
+    argparse::ArgumentParser program("flatt serve");
+    program.add_argument("--socket").help("unix socket to listen on").default_value(server::default_socket().string());
+    program.add_argument("--plain").help("no banner or colors").default_value(false).implicit_value(true);
+
+    try {
+      program.parse_args(argc - 1, argv + 1);
+    } catch (const std::exception &err) {
+      setup_console(true);
+      spdlog::error(err.what());
+      return 1;
+    }
+    setup_console(program.get<bool>("--plain"));
+
+    return server::serve(program.get<std::string>("--socket"), [](const server::request &req) {
+      run_environment = std::vector<std::string>{};
+      for (auto &[name, value] : req.env) {
+        run_environment->push_back(name + "=" + value);
+      }
+      auto status = run_tracked(path(req.cwd) / req.project, req.arguments, req.depfile, req.manifest);
+      run_environment.reset();
+      return status;
+    });
+  }
+
+  // `flatt run ...` is the explicit spelling of the default command
+  if (command == "run") {
+    argc -= 1;
+    argv += 1;
+  }
+
+  argparse::ArgumentParser program("flatt", FLATT_VERSION);
+  program.add_argument("--watch")
+    .help("re-run the project whenever a file it read changes")
+    .default_value(false)
+    .implicit_value(true);
+  program.add_argument("--daemon")
+    .help("run inside the `flatt serve` daemon, or in-process when none is listening")
+    .default_value(false)
+    .implicit_value(true);
+  program.add_argument("--socket").help("daemon socket").default_value(server::default_socket().string());
+  program.add_argument("--depfile").help("write a Make style depfile of every file the run read");
+  program.add_argument("--outputs").help("write the list of files the run generated, one per line");
+  program.add_argument("--cache-dir").help("reuse task outputs stored in this directory (FLATT_CACHE_DIR)");
+  program.add_argument("--plain")
+    .help("no banner or colors, for scripted and CI runs")
+    .default_value(false)
+    .implicit_value(true);
+  program.add_argument("--timings")
+    .help("log how long each startup phase took")
+    .default_value(false)
+    .implicit_value(true);
+  program.add_argument("--profile-lua").help("sample the script and write collapsed stacks for flamegraphs");
+  program.add_argument("--trace").help("write Chrome trace events of file, process, reflection and binding spans");
+  program.add_argument("--stats")
+    .help("log file, process, reflection, template and cache counters after each run")
+    .default_value(false)
+    .implicit_value(true);
+  program.add_argument("--stats-json").help("write the counters of each run to this file as JSON");
+  program.add_argument("--lua-gc")
+    .help("Lua collector mode: incremental or generational (Lua 5.4)")
+    .default_value(std::string("incremental"));
+  program.add_argument("--lua-memory").help("limit the project's Lua state to this many MiB").scan<'i', int>();
+  program.add_argument("project")
+    .help("project file or directory, the arguments after it are forwarded to the script as flatt.argv")
+    .default_value(std::string("./flatt.lua"));
+
+  // flatt's options come before the project, everything after it belongs to
+  // the script as is, even when it looks like one of flatt's options
+  const auto valued = std::vector<std::string_view>{ "--socket",      "--depfile", "--outputs",
+                                                     "--cache-dir",   "--trace",   "--profile-lua",
+                                                     "--stats-json",  "--lua-gc",  "--lua-memory" };
+  auto project_index = 1;
+  while (project_index < argc && argv[project_index][0] == '-') {
+    auto is_valued = find(valued.begin(), valued.end(), std::string_view(argv[project_index])) != valued.end();
+    project_index += is_valued ? 2 : 1;
+  }
+  auto split = min(project_index + 1, argc);
+  auto arguments = std::vector<std::string>(argv + split, argv + argc);
+
+  try {
+    program.parse_args(std::vector<std::string>(argv, argv + split));
+  } catch (const std::exception &err) {
+    setup_console(true);
+    spdlog::error(err.what());
+    return 1;
+  }
+
+  startup.enabled = program.get<bool>("--timings");
+  startup.mark("arguments");
+  setup_console(program.get<bool>("--plain"));
+  startup.mark("console");
+
+  auto file = program.get<std::string>("project");
+  auto watching = program.get<bool>("--watch");
+
+  // relative to where flatt was invoked, not the project directory
+  auto output_path = [&](const std::string &name) {
+    auto value = program.present<std::string>(name);
+    return value.has_value() ? filesystem::absolute(value.value()).string() : std::string();
+  };
+  auto depfile = output_path("--depfile");
+  auto manifest = output_path("--outputs");
+  lua_profile = output_path("--profile-lua");
+  trace_output = output_path("--trace");
+  if (!trace_output.empty()) {
+    trace::start();
+  }
+  log_stats = program.get<bool>("--stats");
+  stats_output = output_path("--stats-json");
+
+  lua_gc_mode = program.get<std::string>("--lua-gc");
+  if (lua_gc_mode != "incremental" && lua_gc_mode != "generational") {
+    spdlog::error("Unknown Lua collector mode: {}", lua_gc_mode);
+    return 1;
+  }
+  if (auto limit = program.present<int>("--lua-memory"); limit.has_value()) {
+#ifdef LUAJIT_VERSION
+    spdlog::warn("--lua-memory is ignored, LuaJIT manages its own memory");
+#endif
+    lua_memory_limit = static_cast<size_t>(max(limit.value(), 0)) * 1024 * 1024;
+  }
 
-  std::vector<std::string> arguments;
-  std::copy(argv, argv + argc, std::back_inserter(arguments));
+  // passed through the environment so daemon runs see it too
+  if (auto cache_dir = output_path("--cache-dir"); !cache_dir.empty()) {
+#ifdef _WIN32
+    _putenv_s("FLATT_CACHE_DIR", cache_dir.c_str());
+#else
+    setenv("FLATT_CACHE_DIR", cache_dir.c_str(), 1);
+#endif
+  }
 
-  if (arguments.size() < 2) {
-    arguments.push_back("./flatt.lua");
+  // the daemon doesn't profile, trace, count or tune its Lua states, that
+  // stays in-process
+  auto instrumented = !lua_profile.empty() || !trace_output.empty() || log_stats || !stats_output.empty();
+  auto tuned = lua_gc_mode != "incremental" || lua_memory_limit != 0;
+  if (program.get<bool>("--daemon") && !watching && !instrumented && !tuned) {
+    auto socket = program.get<std::string>("--socket");
+    auto req = server::current(file, arguments);
+    req.depfile = depfile;
+    req.manifest = manifest;
+    auto status = server::forward(socket, req);
+    if (status.has_value()) {
+      return status.value();
+    }
+    spdlog::debug("No daemon available on {}, running in-process", socket);
   }
 
-  auto file = arguments[1];
-  arguments.erase(arguments.begin(), arguments.begin() + 2);
+  if (!watching) {
+    return run_tracked(file, arguments, depfile, manifest);
+  }
 
-  return run_project(file, arguments);
+  // the project changes the working directory, reruns need an absolute path
+  auto entrypoint = filesystem::absolute(file);
+  while (true) {
+    auto status = run_tracked(entrypoint, arguments, depfile, manifest);
+
+    auto inputs = deps::inputs();
+    if (inputs.empty()) {
+      return status;
+    }
+
+    spdlog::info("Watching {} files for changes...", inputs.size());
+    for (auto &changed : watch::wait(inputs, deps::seen())) {
+      spdlog::info("Changed: {}", changed);
+    }
+  }
 }
@@ -0,0 +1,103 @@
+#include <string>
+
+#include "./marshal.hpp"
+
+using namespace std;
+
+namespace {
+
+  constexpr int max_depth = 1000;
+
+  optional<marshal::value> capture(lua_State *L, int index, string &error, int depth) {
+    switch (lua_type(L, index)) {
+    case LUA_TNIL:
+      return marshal::value{};
+    case LUA_TBOOLEAN:
+      return marshal::value{ lua_toboolean(L, index) != 0 };
+    case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+      if (lua_isinteger(L, index)) {
+        return marshal::value{ lua_tointeger(L, index) };
+      }
+#endif
+      return marshal::value{ lua_tonumber(L, index) };
+    case LUA_TSTRING: {
+      size_t size = 0;
+      auto data = lua_tolstring(L, index, &size);
+      return marshal::value{ string(data, size) };
+    }
+    case LUA_TLIGHTUSERDATA:
+      return marshal::value{ lua_touserdata(L, index) };
+    case LUA_TTABLE:
+      break;
+    default:
+      error = string("cannot copy a ") + lua_typename(L, lua_type(L, index)) + " value";
+      return nullopt;
+    }
+
+    if (depth >= max_depth || !lua_checkstack(L, 3)) {
+      error = "table nested too deeply (cyclic?)";
+      return nullopt;
+    }
+
+    if (index < 0) {
+      index = lua_gettop(L) + index + 1;
+    }
+
+    auto entries = make_shared<marshal::table>();
+    lua_pushnil(L);
+    while (lua_next(L, index) != 0) {
+      auto key = capture(L, -2, error, depth + 1);
+      auto entry = key.has_value() ? capture(L, -1, error, depth + 1) : nullopt;
+      if (!entry.has_value()) {
+        lua_pop(L, 2);
+        return nullopt;
+      }
+      entries->emplace_back(move(key.value()), move(entry.value()));
+      lua_pop(L, 1);
+    }
+
+    return marshal::value{ shared_ptr<const marshal::table>(move(entries)) };
+  }
+
+  struct pusher {
+    lua_State *L;
+
+    void operator()(monostate) const {
+      lua_pushnil(L);
+    }
+    void operator()(bool value) const {
+      lua_pushboolean(L, value);
+    }
+    void operator()(lua_Integer value) const {
+      lua_pushinteger(L, value);
+    }
+    void operator()(lua_Number value) const {
+      lua_pushnumber(L, value);
+    }
+    void operator()(const string &value) const {
+      lua_pushlstring(L, value.data(), value.size());
+    }
+    void operator()(void *value) const {
+      lua_pushlightuserdata(L, value);
+    }
+    void operator()(const shared_ptr<const marshal::table> &entries) const {
+      lua_checkstack(L, 3);
+      lua_createtable(L, 0, static_cast<int>(entries->size()));
+      for (auto &[key, entry] : *entries) {
+        marshal::push(L, key);
+        marshal::push(L, entry);
+        lua_rawset(L, -3);
+      }
+    }
+  };
+
+} // namespace
+
+optional<marshal::value> marshal::capture(lua_State *L, int index, string &error) {
+  return ::capture(L, index, error, 0);
+}
+
+void marshal::push(lua_State *L, const value &value) {
+  visit(pusher{ L }, value.data);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <lua.hpp>
+
+namespace marshal {
+
+  struct value;
+  using table = std::vector<std::pair<value, value>>;
+
+  // A Lua value copied out of one state so it can be pushed into another,
+  // possibly owned by another thread: nil, booleans, numbers, strings, light
+  // userdata (such as json.null) and tables of those, without metatables.
+  struct value {
+    std::variant<std::monostate, bool, lua_Integer, lua_Number, std::string, void *, std::shared_ptr<const table>> data;
+  };
+
+  // Copies the value at `index`. Functions, full userdata, threads and tables
+  // nested deeper than 1000 levels (e.g. cycles) give nullopt and `error`.
+  std::optional<value> capture(lua_State *L, int index, std::string &error);
+
+  // Pushes a copy of `value`.
+  void push(lua_State *L, const value &value);
+
+} // namespace marshal
@@ -0,0 +1,360 @@
+#ifdef _WIN32
+  #include <process.h>
+#else
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+#ifdef FLATT_HAS_IO_URING
+  #include <liburing.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <unordered_set>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "./deps.hpp"
+#include "./output.hpp"
+#include "./parallel.hpp"
+#include "./stats.hpp"
+#include "./trace.hpp"
+
+using namespace std;
+using namespace std::filesystem;
+
+namespace {
+
+  constexpr size_t max_queued_bytes = 64 * 1024 * 1024;
+  constexpr size_t max_queued_files = 4096;
+
+  struct entry {
+    path target;
+    path temp;
+    string data;
+  };
+
+  struct state {
+    mutex lock;
+    vector<entry> entries;
+    unordered_set<string> targets;
+    size_t bytes = 0;
+
+    mutex directories_lock;
+    unordered_set<string> directories;
+  };
+
+  state &writes() {
+    static state instance;
+    return instance;
+  }
+
+  string key(const path &p) {
+    return absolute(p).lexically_normal().generic_string();
+  }
+
+  path temp_path(const path &p) {
+    static atomic<uint64_t> counter = 0;
+#ifdef _WIN32
+    auto pid = _getpid();
+#else
+    auto pid = getpid();
+#endif
+    auto temp = p;
+    temp += ".flatt-" + to_string(pid) + "-" + to_string(counter++) + ".tmp";
+    return temp;
+  }
+
+  // Writes go through symlinks to the file they point to, like writing the
+  // file in place would.
+  path resolve(const path &p) {
+    auto result = p;
+    error_code ec;
+    for (auto hops = 0; hops < 40 && is_symlink(result, ec); hops++) {
+      auto link = read_symlink(result, ec);
+      if (ec) {
+        break;
+      }
+      result = link.is_absolute() ? link : result.parent_path() / link;
+    }
+    return result;
+  }
+
+  entry make_entry(const path &p, string data) {
+    auto target = resolve(p);
+    auto temp = temp_path(target);
+    return entry{ .target = move(target), .temp = move(temp), .data = move(data) };
+  }
+
+  void ensure_directory(const path &dir) {
+    if (dir.empty()) {
+      return;
+    }
+
+    auto &w = writes();
+    auto name = dir.generic_string();
+    {
+      auto lock = lock_guard(w.directories_lock);
+      if (w.directories.count(name) > 0) {
+        return;
+      }
+    }
+
+    error_code ec;
+    create_directories(dir, ec);
+    if (!ec) {
+      auto lock = lock_guard(w.directories_lock);
+      w.directories.insert(name);
+    }
+  }
+
+  // The directory cache outlives a run in watch mode, so a directory removed
+  // in between is only noticed when opening a file inside it fails.
+  void recreate_directory(const path &dir) {
+    auto &w = writes();
+    {
+      auto lock = lock_guard(w.directories_lock);
+      w.directories.erase(dir.generic_string());
+    }
+    ensure_directory(dir);
+  }
+
+  bool commit(const entry &e) {
+    error_code ec;
+    // the replaced file keeps its permissions
+    auto previous = status(e.target, ec);
+    if (!ec && exists(previous)) {
+      permissions(e.temp, previous.permissions(), ec);
+    }
+    rename(e.temp, e.target, ec);
+    if (ec) {
+      spdlog::error("Unable to write {}: {}", e.target.string(), ec.message());
+      remove(e.temp, ec);
+      return false;
+    }
+    stats::add(stats::counter::files_written);
+    stats::add(stats::counter::bytes_written, e.data.size());
+    return true;
+  }
+
+  bool write_entry(const entry &e) {
+    ensure_directory(e.target.parent_path());
+
+    {
+      ofstream ofs(e.temp, ios::binary | ios::trunc);
+      if (!ofs.is_open() && !e.target.parent_path().empty()) {
+        recreate_directory(e.target.parent_path());
+        ofs.open(e.temp, ios::binary | ios::trunc);
+      }
+      ofs.write(e.data.data(), e.data.size());
+      ofs.close();
+      if (ofs.fail()) {
+        spdlog::error("Unable to write {}", e.target.string());
+        error_code ec;
+        remove(e.temp, ec);
+        return false;
+      }
+    }
+
+    return commit(e);
+  }
+
+  bool write_pool(const vector<entry> &entries) {
+    atomic<bool> success = true;
+    parallel::for_each(entries.size(), [&](size_t index) {
+      if (!write_entry(entries[index])) {
+        success = false;
+      }
+    });
+    return success;
+  }
+
+#ifdef FLATT_HAS_IO_URING
+
+  constexpr unsigned ring_depth = 256;
+
+  // Returns nullopt when io_uring is unavailable (old kernel, seccomp, ...).
+  optional<bool> write_uring(const vector<entry> &entries) {
+    io_uring ring;
+    if (io_uring_queue_init(ring_depth, &ring, 0) < 0) {
+      return {};
+    }
+
+    auto fds = vector<int>(entries.size(), -1);
+    auto written = vector<size_t>(entries.size(), 0);
+    auto failed = vector<bool>(entries.size(), false);
+
+    auto prepare = [&](size_t index) {
+      auto sqe = io_uring_get_sqe(&ring);
+      auto &data = entries[index].data;
+      io_uring_prep_write(
+        sqe, fds[index], data.data() + written[index], data.size() - written[index], written[index]);
+      io_uring_sqe_set_data64(sqe, index);
+    };
+
+    for (size_t start = 0; start < entries.size(); start += ring_depth) {
+      auto end = min(entries.size(), start + ring_depth);
+      auto in_flight = 0u;
+
+      for (auto i = start; i < end; i++) {
+        ensure_directory(entries[i].target.parent_path());
+        fds[i] = open(entries[i].temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fds[i] < 0 && errno == ENOENT) {
+          recreate_directory(entries[i].target.parent_path());
+          fds[i] = open(entries[i].temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        }
+        if (fds[i] < 0) {
+          spdlog::error("Unable to write {}: {}", entries[i].target.string(), strerror(errno));
+          failed[i] = true;
+          continue;
+        }
+        if (!entries[i].data.empty()) {
+          prepare(i);
+          in_flight++;
+        }
+      }
+
+      io_uring_submit(&ring);
+
+      while (in_flight > 0) {
+        io_uring_cqe *cqe = nullptr;
+        auto waited = io_uring_wait_cqe(&ring, &cqe);
+        if (waited == -EINTR) {
+          continue;
+        }
+        if (waited < 0) {
+          spdlog::error("io_uring wait failed: {}", strerror(-waited));
+          fill(failed.begin() + start, failed.begin() + end, true);
+          break;
+        }
+
+        auto index = static_cast<size_t>(io_uring_cqe_get_data64(cqe));
+        auto res = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+        in_flight--;
+
+        if (res > 0) {
+          written[index] += res;
+        } else if (res != -EINTR && res != -EAGAIN) {
+          spdlog::error("Unable to write {}: {}", entries[index].target.string(), strerror(res == 0 ? EIO : -res));
+          failed[index] = true;
+          continue;
+        }
+
+        // short or interrupted write, queue the rest
+        if (written[index] < entries[index].data.size()) {
+          prepare(index);
+          io_uring_submit(&ring);
+          in_flight++;
+        }
+      }
+
+      for (auto i = start; i < end; i++) {
+        if (fds[i] >= 0 && close(fds[i]) != 0) {
+          spdlog::error("Unable to write {}: {}", entries[i].target.string(), strerror(errno));
+          failed[i] = true;
+        }
+        fds[i] = -1;
+
+        if (failed[i]) {
+          unlink(entries[i].temp.c_str());
+          continue;
+        }
+        failed[i] = !commit(entries[i]);
+      }
+    }
+
+    io_uring_queue_exit(&ring);
+    return find(failed.begin(), failed.end(), true) == failed.end();
+  }
+
+#endif
+
+} // namespace
+
+bool output::write(const path &p, string_view data) {
+  // an older queued write must not land on top of this one
+  if (pending(p)) {
+    flush();
+  }
+
+  deps::wrote(p);
+
+  auto traced = trace::span("io", "write");
+  traced.arg("file", p.string()).arg("bytes", static_cast<int64_t>(data.size()));
+  return write_entry(make_entry(p, string(data)));
+}
+
+void output::queue(const path &p, string data) {
+  deps::wrote(p);
+
+  auto &w = writes();
+  auto full = false;
+  {
+    auto lock = lock_guard(w.lock);
+    w.bytes += data.size();
+    w.targets.insert(key(p));
+    w.entries.push_back(make_entry(p, move(data)));
+    full = w.bytes >= max_queued_bytes || w.entries.size() >= max_queued_files;
+  }
+
+  if (full) {
+    flush();
+  }
+}
+
+bool output::flush() {
+  auto &w = writes();
+  auto entries = vector<entry>{};
+  {
+    auto lock = lock_guard(w.lock);
+    entries.swap(w.entries);
+    w.targets.clear();
+    w.bytes = 0;
+  }
+
+  if (entries.empty()) {
+    return true;
+  }
+
+  auto traced = trace::span("io", "flush");
+
+  // a path queued more than once only keeps its last write
+  auto seen = unordered_set<string>{};
+  auto unique = vector<entry>{};
+  for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+    if (seen.insert(key(it->target)).second) {
+      unique.push_back(move(*it));
+    }
+  }
+
+  if (trace::enabled()) {
+    auto bytes = size_t{};
+    for (auto &e : unique) {
+      bytes += e.data.size();
+    }
+    traced.arg("files", static_cast<int64_t>(unique.size())).arg("bytes", static_cast<int64_t>(bytes));
+  }
+
+#ifdef FLATT_HAS_IO_URING
+  auto result = write_uring(unique);
+  if (result.has_value()) {
+    return result.value();
+  }
+#endif
+
+  return write_pool(unique);
+}
+
+bool output::pending(const path &p) {
+  auto &w = writes();
+  auto lock = lock_guard(w.lock);
+  return !w.targets.empty() && w.targets.count(key(p)) > 0;
+}
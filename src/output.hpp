@@ -0,0 +1,22 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+namespace output {
+
+  // Writes `data` to a temporary file next to `p` and renames it over `p`, so
+  // readers never see a partially written file.
+  bool write(const std::filesystem::path &p, std::string_view data);
+
+  // Queues an atomic write; queued writes are submitted together by `flush`
+  // (io_uring on Linux when available, the worker pool otherwise). The queue
+  // flushes itself once it holds too much data.
+  void queue(const std::filesystem::path &p, std::string data);
+  bool flush();
+
+  // Whether `p` has a queued write that hasn't been flushed yet.
+  bool pending(const std::filesystem::path &p);
+
+} // namespace output
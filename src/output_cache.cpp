@@ -0,0 +1,186 @@
+#ifdef _WIN32
+  #include <process.h>
+#else
+  #include <unistd.h>
+#endif
+
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <sstream>
+
+#include <spdlog/spdlog.h>
+
+#include "./output.hpp"
+#include "./output_cache.hpp"
+
+using namespace std;
+using namespace std::filesystem;
+
+namespace {
+
+  struct state {
+    mutex lock;
+    path dir;
+    output_cache::stats counters;
+  };
+
+  state &cache() {
+    static state instance;
+    return instance;
+  }
+
+  // <dir>/<first two digits>/<key>/{manifest,0,1,...}
+  path entry_dir(const path &dir, const string &key) {
+    return dir / key.substr(0, 2) / key;
+  }
+
+  optional<string> read_whole(const path &p) {
+    ifstream ifs(p, ios::binary);
+    if (!ifs.is_open()) {
+      return {};
+    }
+    auto buffer = stringstream{};
+    buffer << ifs.rdbuf();
+    return buffer.str();
+  }
+
+  string manifest(const vector<string> &outputs) {
+    auto content = string{};
+    for (auto &output : outputs) {
+      content += path(output).lexically_normal().lexically_proximate(current_path()).generic_string();
+      content += '\n';
+    }
+    return content;
+  }
+
+  void count(size_t output_cache::stats::*counter) {
+    auto &c = cache();
+    auto lock = lock_guard(c.lock);
+    c.counters.*counter += 1;
+  }
+
+} // namespace
+
+void output_cache::open(const path &dir) {
+  auto &c = cache();
+  auto lock = lock_guard(c.lock);
+  c.dir = dir;
+  c.counters = {};
+}
+
+bool output_cache::enabled() {
+  auto &c = cache();
+  auto lock = lock_guard(c.lock);
+  return !c.dir.empty();
+}
+
+bool output_cache::restore(const string &key, const vector<string> &outputs) {
+  auto dir = path{};
+  {
+    auto &c = cache();
+    auto lock = lock_guard(c.lock);
+    dir = c.dir;
+  }
+  if (dir.empty()) {
+    return false;
+  }
+
+  auto entry = entry_dir(dir, key);
+
+  // the key covers the outputs list, this only guards against damaged entries
+  auto listed = read_whole(entry / "manifest");
+  if (!listed.has_value() || listed.value() != manifest(outputs)) {
+    count(&stats::misses);
+    return false;
+  }
+
+  auto contents = vector<string>{};
+  for (size_t i = 0; i < outputs.size(); i++) {
+    auto content = read_whole(entry / to_string(i));
+    if (!content.has_value()) {
+      count(&stats::misses);
+      return false;
+    }
+    contents.push_back(move(content.value()));
+  }
+
+  for (size_t i = 0; i < outputs.size(); i++) {
+    if (!output::write(outputs[i], contents[i])) {
+      count(&stats::misses);
+      return false;
+    }
+  }
+
+  count(&stats::hits);
+  return true;
+}
+
+bool output_cache::store(const string &key, const vector<string> &outputs) {
+  static atomic<uint64_t> counter = 0;
+
+  auto dir = path{};
+  {
+    auto &c = cache();
+    auto lock = lock_guard(c.lock);
+    dir = c.dir;
+  }
+  if (dir.empty()) {
+    return false;
+  }
+
+  auto entry = entry_dir(dir, key);
+
+  error_code ec;
+  if (exists(entry / "manifest", ec)) {
+    return true;
+  }
+
+  // outputs written with file.write_async may still be queued
+  output::flush();
+
+#ifdef _WIN32
+  auto pid = _getpid();
+#else
+  auto pid = getpid();
+#endif
+  auto staging = dir / "tmp" / (key + "." + to_string(pid) + "." + to_string(counter++));
+  create_directories(staging, ec);
+  if (ec) {
+    spdlog::warn("Unable to use the output cache: {}", ec.message());
+    return false;
+  }
+
+  auto staged = true;
+  for (size_t i = 0; i < outputs.size() && staged; i++) {
+    copy_file(outputs[i], staging / to_string(i), copy_options::overwrite_existing, ec);
+    staged = !ec;
+  }
+  if (staged) {
+    ofstream ofs(staging / "manifest", ios::binary | ios::trunc);
+    ofs << manifest(outputs);
+    ofs.close();
+    staged = !ofs.fail();
+  }
+
+  if (staged) {
+    create_directories(entry.parent_path(), ec);
+    rename(staging, entry, ec);
+    // losing the race to another writer is fine, the entry is the same
+    staged = !ec || exists(entry / "manifest");
+  }
+
+  remove_all(staging, ec);
+
+  if (staged) {
+    count(&stats::stored);
+  }
+  return staged;
+}
+
+output_cache::stats output_cache::counters() {
+  auto &c = cache();
+  auto lock = lock_guard(c.lock);
+  return c.counters;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace output_cache {
+
+  struct stats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t stored = 0;
+  };
+
+  // Keeps generated files in `dir`, which may be shared between projects and
+  // machines. An empty path disables the cache. Counters restart on open.
+  void open(const std::filesystem::path &dir);
+  bool enabled();
+
+  // Writes the files stored under `key` to `outputs`; false on a miss.
+  bool restore(const std::string &key, const std::vector<std::string> &outputs);
+
+  // Copies `outputs` into the cache under `key`. Entries are built in a
+  // private directory and published with a single rename, so concurrent
+  // writers never expose a partial entry and the first one wins.
+  bool store(const std::string &key, const std::vector<std::string> &outputs);
+
+  stats counters();
+
+} // namespace output_cache
@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "./parallel.hpp"
+
+using namespace std;
+
+// set while the thread runs tasks of a for_each
+static thread_local bool in_task = false;
+
+size_t parallel::concurrency() {
+  return max<size_t>(thread::hardware_concurrency(), 1);
+}
+
+void parallel::for_each(size_t count, const function<void(size_t)> &task, size_t workers) {
+  for_each_worker(
+    count,
+    [&](size_t, size_t index) {
+      task(index);
+    },
+    workers);
+}
+
+void parallel::for_each_worker(size_t count, const function<void(size_t, size_t)> &task, size_t workers) {
+  if (count == 0) {
+    return;
+  }
+
+  workers = in_task ? 1 : min(workers == 0 ? concurrency() : workers, count);
+
+  atomic<size_t> next = 0;
+  exception_ptr failure;
+  mutex failure_lock;
+
+  auto work = [&](size_t worker) {
+    auto outer = in_task;
+    in_task = true;
+    for (auto index = next++; index < count; index = next++) {
+      try {
+        task(worker, index);
+      } catch (...) {
+        auto lock = lock_guard(failure_lock);
+        if (!failure) {
+          failure = current_exception();
+        }
+        next = count;
+      }
+    }
+    in_task = outer;
+  };
+
+  auto threads = vector<thread>{};
+  threads.reserve(workers - 1);
+  for (size_t i = 1; i < workers; i++) {
+    threads.emplace_back(work, i);
+  }
+
+  work(0);
+
+  for (auto &worker : threads) {
+    worker.join();
+  }
+
+  if (failure) {
+    rethrow_exception(failure);
+  }
+}
+
+parallel::pool::pool(size_t workers) {
+  workers = workers == 0 ? concurrency() : workers;
+  _workers.reserve(workers);
+  for (size_t i = 0; i < workers; i++) {
+    _workers.emplace_back([this]() {
+      work();
+    });
+  }
+}
+
+parallel::pool::~pool() {
+  {
+    auto lock = lock_guard(_lock);
+    _stopping = true;
+  }
+  _ready.notify_all();
+
+  for (auto &worker : _workers) {
+    worker.join();
+  }
+}
+
+void parallel::pool::submit(function<void()> task) {
+  {
+    auto lock = lock_guard(_lock);
+    _tasks.push_back(move(task));
+  }
+  _ready.notify_one();
+}
+
+void parallel::pool::work() {
+  while (true) {
+    auto task = function<void()>{};
+    {
+      auto lock = unique_lock(_lock);
+      _ready.wait(lock, [this]() {
+        return _stopping || !_tasks.empty();
+      });
+      if (_tasks.empty()) {
+        return;
+      }
+      task = move(_tasks.front());
+      _tasks.pop_front();
+    }
+    task();
+  }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace parallel {
+
+  size_t concurrency();
+
+  // Runs `task(index)` for every index in [0, count) on up to `workers`
+  // threads (0 = one per core). The calling thread takes part in the work.
+  // The first exception thrown by a task is rethrown once all threads are done.
+  // Called from within a task, it runs on the calling thread only, so nested
+  // loops don't multiply the number of threads.
+  void for_each(size_t count, const std::function<void(size_t)> &task, size_t workers = 0);
+
+  // Like `for_each`, also passing `task` the number of the thread running it,
+  // in [0, workers), to index per-thread state. The calling thread is 0.
+  void for_each_worker(size_t count, const std::function<void(size_t worker, size_t index)> &task, size_t workers = 0);
+
+  // Fixed set of worker threads (0 = one per core) running queued tasks in
+  // submission order. Destroying the pool finishes the queue before joining.
+  class pool {
+  public:
+    explicit pool(size_t workers = 0);
+    pool(const pool &) = delete;
+    ~pool();
+
+    pool &operator=(const pool &) = delete;
+
+    void submit(std::function<void()> task);
+
+  private:
+    void work();
+
+    std::mutex _lock;
+    std::condition_variable _ready;
+    std::deque<std::function<void()>> _tasks;
+    std::vector<std::thread> _workers;
+    bool _stopping = false;
+  };
+
+} // namespace parallel
@@ -0,0 +1,383 @@
+#ifndef WIN32_LEAN_AND_MEAN
+  #define WIN32_LEAN_AND_MEAN
+#endif
+
+#ifndef NOMINMAX
+  #define NOMINMAX
+#endif
+
+#ifdef _WIN32
+  #include <windows.h>
+  #include <algorithm>
+  #include <thread>
+#else
+  #include <cerrno>
+  #include <cstring>
+  #include <fcntl.h>
+  #include <poll.h>
+  #include <spawn.h>
+  #include <sys/wait.h>
+  #include <unistd.h>
+
+extern char **environ;
+
+  #if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+    #define FLATT_HAS_PIPE2
+  #endif
+#endif
+
+#include <mutex>
+
+#include <spdlog/spdlog.h>
+
+#include "./async.hpp"
+#include "./output.hpp"
+#include "./parallel.hpp"
+#include "./process.hpp"
+#include "./stats.hpp"
+#include "./strings.hpp"
+#include "./trace.hpp"
+
+using namespace std;
+
+// Held from creating a child's pipes until it is started where the pipes
+// can't be created non-inheritable at once: jobs spawn from several threads,
+// and a child inheriting another job's write end keeps it from seeing EOF.
+#if defined(_WIN32) || !defined(FLATT_HAS_PIPE2)
+static mutex spawning;
+#endif
+
+#ifdef _WIN32
+
+static wstring widen(const string &value) {
+  if (value.empty()) {
+    return {};
+  }
+  auto size = MultiByteToWideChar(CP_UTF8, 0, value.data(), (int)value.size(), nullptr, 0);
+  auto result = wstring(size, L'\0');
+  MultiByteToWideChar(CP_UTF8, 0, value.data(), (int)value.size(), result.data(), size);
+  return result;
+}
+
+// Quotes an argument the way CommandLineToArgvW / the MSVC runtime parse it back.
+static void append_argument(wstring &command_line, const wstring &arg) {
+  if (!command_line.empty()) {
+    command_line += L' ';
+  }
+
+  if (!arg.empty() && arg.find_first_of(L" \t\n\v\"") == wstring::npos) {
+    command_line += arg;
+    return;
+  }
+
+  command_line += L'"';
+  for (auto it = arg.begin();; ++it) {
+    size_t backslashes = 0;
+    while (it != arg.end() && *it == L'\\') {
+      ++it;
+      ++backslashes;
+    }
+
+    if (it == arg.end()) {
+      command_line.append(backslashes * 2, L'\\');
+      break;
+    } else if (*it == L'"') {
+      command_line.append(backslashes * 2 + 1, L'\\');
+      command_line += *it;
+    } else {
+      command_line.append(backslashes, L'\\');
+      command_line += *it;
+    }
+  }
+  command_line += L'"';
+}
+
+static void drain(HANDLE handle, string &output) {
+  char buffer[4096];
+  DWORD read = 0;
+  while (ReadFile(handle, buffer, sizeof(buffer), &read, nullptr) && read > 0) {
+    output.append(buffer, read);
+  }
+}
+
+process::result process::run(const string &program, const vector<string> &args, const options &opts) {
+  // the child may read files still queued for writing
+  output::flush();
+
+  auto traced = trace::span("process", "run");
+  if (trace::enabled()) {
+    traced.arg("program", program).arg("arguments", str::join(args, " "));
+  }
+
+  auto res = result{};
+
+  auto command_line = wstring{};
+  append_argument(command_line, widen(program));
+  for (auto &arg : args) {
+    append_argument(command_line, widen(arg));
+  }
+
+  SECURITY_ATTRIBUTES security{ sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE };
+  HANDLE out_read = nullptr, out_write = nullptr, err_read = nullptr, err_write = nullptr;
+
+  STARTUPINFOW startup{};
+  startup.cb = sizeof(startup);
+
+  auto spawn_lock = unique_lock(spawning);
+  if (opts.capture) {
+    if (!CreatePipe(&out_read, &out_write, &security, 0) || !CreatePipe(&err_read, &err_write, &security, 0)) {
+      spdlog::error("Unable to create pipes for: {}", program);
+      return res;
+    }
+    SetHandleInformation(out_read, HANDLE_FLAG_INHERIT, 0);
+    SetHandleInformation(err_read, HANDLE_FLAG_INHERIT, 0);
+
+    startup.dwFlags = STARTF_USESTDHANDLES;
+    startup.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    startup.hStdOutput = out_write;
+    startup.hStdError = err_write;
+  }
+
+  auto cwd = opts.cwd.empty() ? wstring{} : opts.cwd.wstring();
+
+  // a sorted block of NUL terminated entries, closed by an empty one
+  auto environment = wstring{};
+  if (opts.environment.has_value()) {
+    auto entries = vector<wstring>{};
+    for (auto &entry : opts.environment.value()) {
+      entries.push_back(widen(entry));
+    }
+    sort(entries.begin(), entries.end());
+    for (auto &entry : entries) {
+      environment += entry;
+      environment += L'\0';
+    }
+    environment += L'\0';
+  }
+
+  spdlog::trace("");
+  spdlog::trace(" spawn: {} {}", program, str::join(args, " "));
+  spdlog::trace("");
+
+  PROCESS_INFORMATION info{};
+  auto started = CreateProcessW(
+    nullptr, command_line.data(), nullptr, nullptr, TRUE, environment.empty() ? 0 : CREATE_UNICODE_ENVIRONMENT,
+    environment.empty() ? nullptr : environment.data(), cwd.empty() ? nullptr : cwd.c_str(), &startup, &info);
+
+  if (opts.capture) {
+    CloseHandle(out_write);
+    CloseHandle(err_write);
+  }
+  spawn_lock.unlock();
+
+  if (!started) {
+    spdlog::error("Unable to start: {} (error {})", program, GetLastError());
+    if (opts.capture) {
+      CloseHandle(out_read);
+      CloseHandle(err_read);
+    }
+    return res;
+  }
+  stats::add(stats::counter::processes_spawned);
+
+  if (opts.capture) {
+    auto err_reader = thread([&]() {
+      drain(err_read, res.err);
+    });
+    drain(out_read, res.out);
+    err_reader.join();
+    CloseHandle(out_read);
+    CloseHandle(err_read);
+  }
+
+  WaitForSingleObject(info.hProcess, INFINITE);
+
+  DWORD code = 0;
+  GetExitCodeProcess(info.hProcess, &code);
+  res.status = static_cast<int>(code);
+
+  CloseHandle(info.hThread);
+  CloseHandle(info.hProcess);
+
+  return res;
+}
+
+#else
+
+static bool open_pipe(int fds[2]) {
+#ifdef FLATT_HAS_PIPE2
+  return pipe2(fds, O_CLOEXEC) == 0;
+#else
+  if (pipe(fds) != 0) {
+    return false;
+  }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  return true;
+#endif
+}
+
+static void close_fd(int &fd) {
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+// Reads both pipes until they are closed, without letting either one fill up.
+static void drain(int out, int err, string &out_data, string &err_data) {
+  pollfd fds[2] = { { out, POLLIN, 0 }, { err, POLLIN, 0 } };
+  string *targets[2] = { &out_data, &err_data };
+  char buffer[16 * 1024];
+
+  auto open = 2;
+  while (open > 0) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    for (auto i = 0; i < 2; i++) {
+      if (fds[i].fd < 0 || fds[i].revents == 0) {
+        continue;
+      }
+
+      auto count = read(fds[i].fd, buffer, sizeof(buffer));
+      if (count > 0) {
+        targets[i]->append(buffer, count);
+      } else if (count == 0 || errno != EINTR) {
+        fds[i].fd = -1;
+        open--;
+      }
+    }
+  }
+}
+
+process::result process::run(const string &program, const vector<string> &args, const options &opts) {
+  // the child may read files still queued for writing
+  output::flush();
+
+  auto traced = trace::span("process", "run");
+  if (trace::enabled()) {
+    traced.arg("program", program).arg("arguments", str::join(args, " "));
+  }
+
+  auto res = result{};
+
+#ifndef FLATT_HAS_PIPE2
+  auto spawn_lock = unique_lock(spawning);
+#endif
+
+  int out_pipe[2] = { -1, -1 };
+  int err_pipe[2] = { -1, -1 };
+  if (opts.capture && (!open_pipe(out_pipe) || !open_pipe(err_pipe))) {
+    spdlog::error("Unable to create pipes for: {}", program);
+    close_fd(out_pipe[0]);
+    close_fd(out_pipe[1]);
+    return res;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (opts.capture) {
+    posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, err_pipe[1], STDERR_FILENO);
+  }
+  if (!opts.cwd.empty()) {
+    posix_spawn_file_actions_addchdir_np(&actions, opts.cwd.c_str());
+  }
+
+  auto argv = vector<char *>{};
+  argv.reserve(args.size() + 2);
+  argv.push_back(const_cast<char *>(program.c_str()));
+  for (auto &arg : args) {
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+
+  auto envp = vector<char *>{};
+  if (opts.environment.has_value()) {
+    envp.reserve(opts.environment->size() + 1);
+    for (auto &entry : opts.environment.value()) {
+      envp.push_back(const_cast<char *>(entry.c_str()));
+    }
+    envp.push_back(nullptr);
+  }
+  auto env = opts.environment.has_value() ? envp.data() : environ;
+
+  spdlog::trace("");
+  spdlog::trace(" spawn: {} {}", program, str::join(args, " "));
+  spdlog::trace("");
+
+  pid_t pid = 0;
+  auto search = program.find('/') == string::npos;
+  auto error = search ? posix_spawnp(&pid, program.c_str(), &actions, nullptr, argv.data(), env)
+                      : posix_spawn(&pid, program.c_str(), &actions, nullptr, argv.data(), env);
+
+  posix_spawn_file_actions_destroy(&actions);
+  close_fd(out_pipe[1]);
+  close_fd(err_pipe[1]);
+#ifndef FLATT_HAS_PIPE2
+  spawn_lock.unlock();
+#endif
+
+  if (error != 0) {
+    spdlog::error("Unable to start: {} ({})", program, strerror(error));
+    close_fd(out_pipe[0]);
+    close_fd(err_pipe[0]);
+    return res;
+  }
+  stats::add(stats::counter::processes_spawned);
+
+  if (opts.capture) {
+    drain(out_pipe[0], err_pipe[0], res.out, res.err);
+    close_fd(out_pipe[0]);
+    close_fd(err_pipe[0]);
+  }
+
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      return res;
+    }
+  }
+
+  if (WIFEXITED(status)) {
+    res.status = WEXITSTATUS(status);
+  } else if (WIFSIGNALED(status)) {
+    res.status = 128 + WTERMSIG(status);
+  }
+
+  return res;
+}
+
+#endif
+
+bool process::job::done() const {
+  return _future.wait_for(chrono::seconds(0)) == future_status::ready;
+}
+
+const process::result &process::job::wait() const {
+  return _future.get();
+}
+
+shared_ptr<process::job> process::start(string program, vector<string> args, options opts) {
+  static parallel::pool jobs;
+
+  // flushed now, the job only runs once a pool slot is free
+  output::flush();
+
+  auto task = make_shared<packaged_task<result()>>([program = move(program), args = move(args), opts = move(opts)]() {
+    return run(program, args, opts);
+  });
+
+  auto handle = make_shared<job>(task->get_future().share());
+  jobs.submit([task]() {
+    (*task)();
+    async::notify();
+  });
+
+  return handle;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace process {
+
+  struct options {
+    // Working directory of the child, inherited when empty.
+    std::filesystem::path cwd;
+    // Collects stdout/stderr into the result instead of sharing ours.
+    bool capture = false;
+    // NAME=value entries the child gets instead of our environment.
+    std::optional<std::vector<std::string>> environment;
+  };
+
+  struct result {
+    // Exit code, 128 + signal when killed, -1 when the program couldn't be started.
+    int status = -1;
+    std::string out;
+    std::string err;
+  };
+
+  // Starts `program` directly (no shell) with `args` as argv[1..] and waits for it.
+  // Programs without a directory component are looked up in PATH.
+  result run(const std::string &program, const std::vector<std::string> &args, const options &opts = {});
+
+  class job {
+  public:
+    explicit job(std::shared_future<result> future)
+      : _future(std::move(future)) {
+    }
+
+    bool done() const;
+    const result &wait() const;
+
+  private:
+    std::shared_future<result> _future;
+  };
+
+  // Queues `run` on a shared pool with one slot per core and returns immediately.
+  std::shared_ptr<job> start(std::string program, std::vector<std::string> args, options opts = {});
+
+} // namespace process
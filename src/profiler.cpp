@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "./profiler.hpp"
+#include "./strings.hpp"
+
+using namespace std;
+
+namespace {
+
+  // instructions between checks for a pending sample
+  constexpr int hook_count = 1000;
+  constexpr int max_frames = 200;
+
+  struct sampler {
+    atomic<uint64_t> ticks = 0;
+    atomic<bool> running = false;
+    thread timer;
+    chrono::microseconds interval{};
+
+    // only touched by the hook, which runs on the thread owning the state
+    uint64_t seen = 0;
+    uint64_t samples = 0;
+    unordered_map<string, uint64_t> stacks;
+  };
+
+  sampler &current() {
+    static sampler s;
+    return s;
+  }
+
+  string frame_name(lua_State *L, lua_Debug &ar) {
+    lua_getinfo(L, "Sn", &ar);
+    auto name = string(ar.name != nullptr ? ar.name : "");
+    auto frame = string();
+    if (*ar.what == 'C') {
+      frame = (name.empty() ? "?" : name) + " [C]";
+    } else if (*ar.what == 'm') {
+      frame = string("main chunk ") + ar.short_src;
+    } else {
+      frame = (name.empty() ? "<anonymous>" : name) + " " + ar.short_src + ":" + to_string(ar.linedefined);
+    }
+    // ';' separates frames in the collapsed format
+    replace(frame.begin(), frame.end(), ';', ':');
+    return frame;
+  }
+
+  void hook(lua_State *L, lua_Debug *) {
+    auto &s = current();
+    auto now = s.ticks.load(memory_order_relaxed);
+    if (now == s.seen || !s.running.load(memory_order_relaxed)) {
+      return;
+    }
+    // ticks that passed since the last sample all belong to this stack
+    auto weight = now - s.seen;
+    s.seen = now;
+
+    auto frames = vector<string>{};
+    lua_Debug ar;
+    for (int level = 0; level < max_frames && lua_getstack(L, level, &ar) != 0; level++) {
+      frames.push_back(frame_name(L, ar));
+    }
+    if (frames.empty()) {
+      return;
+    }
+
+    reverse(frames.begin(), frames.end());
+    s.stacks[str::join(frames, ";")] += weight;
+    s.samples += weight;
+  }
+
+} // namespace
+
+void profiler::start(lua_State *L, chrono::microseconds interval) {
+  auto &s = current();
+  stop(L);
+
+  s.stacks.clear();
+  s.samples = 0;
+  s.seen = s.ticks.load();
+  s.interval = interval;
+  s.running = true;
+  s.timer = thread([&s]() {
+    while (s.running.load()) {
+      this_thread::sleep_for(s.interval);
+      s.ticks++;
+    }
+  });
+
+  lua_sethook(L, hook, LUA_MASKCOUNT | LUA_MASKRET, hook_count);
+}
+
+void profiler::stop(lua_State *L) {
+  auto &s = current();
+  if (!s.running.exchange(false)) {
+    return;
+  }
+
+  lua_sethook(L, nullptr, 0, 0);
+  if (s.timer.joinable()) {
+    s.timer.join();
+  }
+}
+
+bool profiler::write(const filesystem::path &file) {
+  auto &s = current();
+
+  auto lines = vector<pair<string_view, uint64_t>>(s.stacks.begin(), s.stacks.end());
+  sort(lines.begin(), lines.end());
+
+  ofstream ofs(file, ios::binary | ios::trunc);
+  for (auto &[stack, count] : lines) {
+    ofs << stack << ' ' << count << '\n';
+  }
+  return ofs.good();
+}
+
+void profiler::summary(size_t count) {
+  auto &s = current();
+  if (s.samples == 0) {
+    spdlog::info("Lua profile: no samples");
+    return;
+  }
+
+  struct totals {
+    uint64_t self = 0;
+    uint64_t total = 0;
+  };
+  auto functions = unordered_map<string_view, totals>{};
+  for (auto &[stack, samples] : s.stacks) {
+    auto frames = str::split(stack, ";", 0);
+    functions[frames.back()].self += samples;
+    // recursion counts once towards the total
+    auto seen = unordered_set<string_view>(frames.begin(), frames.end());
+    for (auto &frame : seen) {
+      functions[frame].total += samples;
+    }
+  }
+
+  auto ranked = vector<pair<string_view, totals>>(functions.begin(), functions.end());
+  sort(ranked.begin(), ranked.end(), [](const auto &a, const auto &b) {
+    return a.second.self != b.second.self ? a.second.self > b.second.self : a.second.total > b.second.total;
+  });
+  ranked.resize(min(ranked.size(), count));
+
+  auto percent = [&](uint64_t samples) {
+    return 100.0 * static_cast<double>(samples) / static_cast<double>(s.samples);
+  };
+  spdlog::info("Lua profile: {} samples of {} us", s.samples, s.interval.count());
+  spdlog::info("  {:>7} {:>7}  function", "self", "total");
+  for (auto &[name, samples] : ranked) {
+    spdlog::info("  {:>6.1f}% {:>6.1f}%  {}", percent(samples.self), percent(samples.total), name);
+  }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+
+#include <lua.hpp>
+
+namespace profiler {
+
+  // Samples the stacks of `L` (and coroutines it creates afterwards) about
+  // every `interval` of wall time. A count hook takes samples in Lua code;
+  // a return hook catches time spent inside C functions (bindings) as they
+  // return, so a slow `fb.reflect` shows up under its own frame.
+  void start(lua_State *L, std::chrono::microseconds interval = std::chrono::milliseconds(1));
+
+  // Removes the hook and stops the timer; samples are kept for `write`.
+  void stop(lua_State *L);
+
+  // Writes the samples as collapsed stacks ("outer;inner count" lines), the
+  // input of flamegraph.pl, inferno and speedscope.
+  bool write(const std::filesystem::path &file);
+
+  // Logs the `count` functions with the most samples of their own.
+  void summary(size_t count = 20);
+
+} // namespace profiler
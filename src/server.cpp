@@ -0,0 +1,499 @@
+#ifndef _WIN32
+  #include <csignal>
+  #include <fcntl.h>
+  #include <pthread.h>
+  #include <sys/socket.h>
+  #include <sys/stat.h>
+  #include <sys/un.h>
+  #include <unistd.h>
+
+extern char **environ;
+#endif
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include <nlohmann/json.hpp>
+#include <spdlog/sinks/base_sink.h>
+#include <spdlog/spdlog.h>
+
+#include "./server.hpp"
+
+using namespace std;
+using namespace std::filesystem;
+using namespace nlohmann;
+
+namespace {
+
+  // Every message is a frame: a little endian u32 payload size, a type byte
+  // and the payload.
+  constexpr char frame_request = 'r'; // client -> daemon, json encoded request
+  constexpr char frame_output = 'o';  // daemon -> client, formatted log line
+  constexpr char frame_exit = 'x';    // daemon -> client, decimal exit status
+  constexpr char frame_busy = 'b';    // daemon -> client, another run is in progress
+
+  constexpr uint32_t max_frame_size = 64 * 1024 * 1024;
+
+#ifndef _WIN32
+
+  bool write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+  #ifdef MSG_NOSIGNAL
+      // a daemon that went away must not kill the client
+      auto written = ::send(fd, data, size, MSG_NOSIGNAL);
+  #else
+      auto written = ::write(fd, data, size);
+  #endif
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written <= 0) {
+        return false;
+      }
+      data += written;
+      size -= written;
+    }
+    return true;
+  }
+
+  bool read_all(int fd, char *data, size_t size) {
+    while (size > 0) {
+      auto count = ::read(fd, data, size);
+      if (count < 0 && errno == EINTR) {
+        continue;
+      }
+      if (count <= 0) {
+        return false;
+      }
+      data += count;
+      size -= count;
+    }
+    return true;
+  }
+
+  bool send_frame(int fd, char type, string_view payload) {
+    auto size = static_cast<uint32_t>(payload.size());
+    char header[5] = {
+      static_cast<char>(size & 0xff),         static_cast<char>((size >> 8) & 0xff),
+      static_cast<char>((size >> 16) & 0xff), static_cast<char>((size >> 24) & 0xff),
+      type,
+    };
+    return write_all(fd, header, sizeof(header)) && write_all(fd, payload.data(), payload.size());
+  }
+
+  optional<pair<char, string>> receive_frame(int fd) {
+    unsigned char header[5];
+    if (!read_all(fd, reinterpret_cast<char *>(header), sizeof(header))) {
+      return {};
+    }
+
+    auto size = uint32_t(header[0]) | uint32_t(header[1]) << 8 | uint32_t(header[2]) << 16 | uint32_t(header[3]) << 24;
+    if (size > max_frame_size) {
+      return {};
+    }
+
+    auto payload = string(size, '\0');
+    if (!read_all(fd, payload.data(), size)) {
+      return {};
+    }
+    return make_pair(static_cast<char>(header[4]), move(payload));
+  }
+
+  int open_socket() {
+    auto fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0) {
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    return fd;
+  }
+
+  optional<sockaddr_un> socket_address(const path &socket) {
+    auto address = sockaddr_un{};
+    address.sun_family = AF_UNIX;
+
+    auto name = socket.string();
+    if (name.size() >= sizeof(address.sun_path)) {
+      spdlog::error("Socket path is too long: {}", name);
+      return {};
+    }
+    memcpy(address.sun_path, name.c_str(), name.size() + 1);
+    return address;
+  }
+
+  // The socket's directory, created private to this user when missing. One
+  // owned by someone else (other than root, e.g. a sticky /tmp) could have
+  // its socket swapped under us.
+  bool prepare_directory(const path &socket) {
+    auto dir = socket.parent_path();
+    if (dir.empty()) {
+      return true;
+    }
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+      spdlog::error("Unable to create {}: {}", dir.string(), strerror(errno));
+      return false;
+    }
+
+    struct stat info;
+    if (lstat(dir.c_str(), &info) != 0 || !S_ISDIR(info.st_mode)) {
+      spdlog::error("Socket directory {} isn't a directory", dir.string());
+      return false;
+    }
+    if (info.st_uid != geteuid() && info.st_uid != 0) {
+      spdlog::error("Socket directory {} belongs to another user", dir.string());
+      return false;
+    }
+    return true;
+  }
+
+  // Only a socket of our own user may receive our working directory,
+  // arguments and environment.
+  bool owned_socket(const path &socket) {
+    struct stat info;
+    if (lstat(socket.c_str(), &info) != 0) {
+      return false;
+    }
+    if (!S_ISSOCK(info.st_mode) || info.st_uid != geteuid()) {
+      spdlog::warn("Ignoring {}, it isn't a socket of this user", socket.string());
+      return false;
+    }
+    return true;
+  }
+
+  bool same_user(int fd) {
+  #ifdef SO_PEERCRED
+    auto credentials = ucred{};
+    auto size = socklen_t(sizeof(credentials));
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size) == 0 && credentials.uid == geteuid();
+  #else
+    uid_t uid = 0;
+    gid_t gid = 0;
+    return getpeereid(fd, &uid, &gid) == 0 && uid == geteuid();
+  #endif
+  }
+
+  int connect_to(const path &socket) {
+    auto address = socket_address(socket);
+    if (!address.has_value()) {
+      return -1;
+    }
+
+    auto fd = open_socket();
+    if (fd < 0) {
+      return -1;
+    }
+    if (connect(fd, reinterpret_cast<const sockaddr *>(&address.value()), sizeof(sockaddr_un)) != 0) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  // Forwards what the run logs to the client; the daemon's own console only
+  // sees connections come and go.
+  class client_sink : public spdlog::sinks::base_sink<mutex> {
+  public:
+    explicit client_sink(int fd)
+      : _fd(fd) {
+    }
+
+  protected:
+    void sink_it_(const spdlog::details::log_msg &msg) override {
+      spdlog::memory_buf_t formatted;
+      formatter_->format(msg, formatted);
+      send_frame(_fd, frame_output, string_view(formatted.data(), formatted.size()));
+    }
+
+    void flush_() override {
+    }
+
+  private:
+    int _fd;
+  };
+
+  vector<pair<string, string>> environment() {
+    auto variables = vector<pair<string, string>>{};
+    for (auto current = environ; *current != nullptr; current++) {
+      auto entry = string_view(*current);
+      auto equals = entry.find('=');
+      if (equals == string_view::npos || equals == 0) {
+        continue;
+      }
+      variables.emplace_back(entry.substr(0, equals), entry.substr(equals + 1));
+    }
+    return variables;
+  }
+
+
+  volatile sig_atomic_t interrupted = 0;
+
+  void on_signal(int) {
+    interrupted = 1;
+  }
+
+  void handle(int fd, const server::handler &run) {
+    auto frame = receive_frame(fd);
+    if (!frame.has_value() || frame->first != frame_request) {
+      spdlog::warn("Ignoring malformed request");
+      return;
+    }
+
+    auto req = server::request{};
+    try {
+      auto data = json::parse(frame->second);
+      req.project = data.at("project").get<string>();
+      req.arguments = data.at("arguments").get<vector<string>>();
+      req.cwd = data.at("cwd").get<string>();
+      req.env = data.at("env").get<vector<pair<string, string>>>();
+      req.depfile = data.value("depfile", "");
+      req.manifest = data.value("manifest", "");
+    } catch (const json::exception &err) {
+      spdlog::warn("Ignoring malformed request: {}", err.what());
+      return;
+    }
+
+    spdlog::info("Running {} (from {})", req.project, req.cwd);
+
+    auto previous_logger = spdlog::default_logger();
+    auto previous_level = spdlog::get_level();
+    error_code ec;
+    auto previous_cwd = current_path(ec);
+
+    auto logger = make_shared<spdlog::logger>("client", make_shared<client_sink>(fd));
+    logger->set_pattern(" %v");
+    logger->set_level(previous_level);
+    spdlog::set_default_logger(logger);
+
+    auto status = -1;
+    current_path(req.cwd, ec);
+    if (ec) {
+      spdlog::error("Unable to enter {}: {}", req.cwd, ec.message());
+    } else {
+      try {
+        status = run(req);
+      } catch (const exception &err) {
+        spdlog::error("{}", err.what());
+      }
+    }
+
+    spdlog::set_default_logger(previous_logger);
+    spdlog::set_level(previous_level);
+    if (!previous_cwd.empty()) {
+      current_path(previous_cwd, ec);
+    }
+
+    send_frame(fd, frame_exit, to_string(status));
+    spdlog::info("Finished {} with status {}", req.project, status);
+  }
+
+#endif
+
+} // namespace
+
+path server::default_socket() {
+  if (auto configured = getenv("FLATT_SOCKET"); configured != nullptr && *configured != '\0') {
+    return configured;
+  }
+  if (auto runtime = getenv("XDG_RUNTIME_DIR"); runtime != nullptr && *runtime != '\0') {
+    return path(runtime) / "flatt.sock";
+  }
+
+  error_code ec;
+  auto temp = temp_directory_path(ec);
+#ifdef _WIN32
+  return temp / "flatt.sock";
+#else
+  // a directory of our own, `flatt serve` creates it with mode 0700
+  return temp / ("flatt-" + to_string(geteuid())) / "flatt.sock";
+#endif
+}
+
+#ifdef _WIN32
+
+int server::serve(const path &, const handler &) {
+  spdlog::error("flatt serve is not supported on this platform");
+  return 1;
+}
+
+optional<int> server::forward(const path &, const request &) {
+  return {};
+}
+
+server::request server::current(string project, vector<string> arguments) {
+  return request{ .project = move(project), .arguments = move(arguments), .cwd = current_path().string() };
+}
+
+#else
+
+int server::serve(const path &socket, const handler &run) {
+  auto address = socket_address(socket);
+  if (!address.has_value() || !prepare_directory(socket)) {
+    return 1;
+  }
+
+  // a leftover socket file is only ours to replace when nobody answers on it
+  auto existing = connect_to(socket);
+  if (existing >= 0) {
+    close(existing);
+    spdlog::error("A daemon is already listening on {}", socket.string());
+    return 1;
+  }
+  unlink(socket.c_str());
+
+  // readable and writable by this user only, from the moment it exists
+  auto fd = open_socket();
+  auto mask = umask(0177);
+  auto bound = fd >= 0 && bind(fd, reinterpret_cast<const sockaddr *>(&address.value()), sizeof(sockaddr_un)) == 0;
+  umask(mask);
+  if (!bound || chmod(socket.c_str(), 0600) != 0 || listen(fd, 64) != 0) {
+    spdlog::error("Unable to listen on {}: {}", socket.string(), strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 1;
+  }
+
+  // clients that go away mid-run must not kill the daemon
+  signal(SIGPIPE, SIG_IGN);
+
+  struct sigaction action = {};
+  action.sa_handler = on_signal;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  spdlog::info("Listening on {}", socket.string());
+
+  // runs share the working directory and logger, so there is one at a time,
+  // on its own thread: clients arriving meanwhile are told the daemon is
+  // busy and run the project themselves rather than queue behind it
+  auto log = spdlog::default_logger();
+  auto running = atomic<bool>{ false };
+  auto runner = thread{};
+
+  // signals stay with this thread, interrupting accept
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+
+  while (!interrupted) {
+  #ifdef SOCK_CLOEXEC
+    auto client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+  #else
+    auto client = accept(fd, nullptr, nullptr);
+    if (client >= 0) {
+      fcntl(client, F_SETFD, FD_CLOEXEC);
+    }
+  #endif
+    if (client < 0) {
+      if (errno != EINTR) {
+        log->error("Unable to accept a connection: {}", strerror(errno));
+      }
+      continue;
+    }
+
+    if (!same_user(client)) {
+      log->warn("Refusing a connection from another user");
+      close(client);
+      continue;
+    }
+
+    // the request is read first, the client only looks for an answer once
+    // it is sent
+    if (running) {
+      auto timeout = timeval{ .tv_sec = 1, .tv_usec = 0 };
+      setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      receive_frame(client);
+      send_frame(client, frame_busy, "");
+      close(client);
+      continue;
+    }
+
+    if (runner.joinable()) {
+      runner.join();
+    }
+    running = true;
+
+    sigset_t previous;
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    runner = thread([client, &run, &running]() {
+      handle(client, run);
+      close(client);
+      running = false;
+    });
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+  }
+
+  if (runner.joinable()) {
+    runner.join();
+  }
+  close(fd);
+  unlink(socket.c_str());
+  return 0;
+}
+
+optional<int> server::forward(const path &socket, const request &req) {
+  if (!owned_socket(socket)) {
+    return {};
+  }
+
+  auto fd = connect_to(socket);
+  if (fd < 0) {
+    return {};
+  }
+
+  auto data = json({
+    { "project", req.project },
+    { "arguments", req.arguments },
+    { "cwd", req.cwd },
+    { "env", req.env },
+    { "depfile", req.depfile },
+    { "manifest", req.manifest },
+  });
+
+  auto status = optional<int>{};
+  auto busy = false;
+  if (send_frame(fd, frame_request, data.dump())) {
+    for (auto frame = receive_frame(fd); frame.has_value(); frame = receive_frame(fd)) {
+      if (frame->first == frame_output) {
+        fwrite(frame->second.data(), 1, frame->second.size(), stdout);
+      } else if (frame->first == frame_exit) {
+        status = atoi(frame->second.c_str());
+        break;
+      } else if (frame->first == frame_busy) {
+        busy = true;
+        break;
+      }
+    }
+    fflush(stdout);
+  }
+
+  close(fd);
+
+  if (busy) {
+    spdlog::debug("The daemon on {} is busy", socket.string());
+    return {};
+  }
+
+  if (!status.has_value()) {
+    spdlog::error("The daemon on {} closed the connection", socket.string());
+    return -1;
+  }
+  return status;
+}
+
+server::request server::current(string project, vector<string> arguments) {
+  return request{
+    .project = move(project),
+    .arguments = move(arguments),
+    .cwd = current_path().string(),
+    .env = environment(),
+  };
+}
+
+#endif
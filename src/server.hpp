@@ -0,0 +1,45 @@
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace server {
+
+  struct request {
+    std::string project;
+    std::vector<std::string> arguments;
+    // The client's working directory, entered for the duration of the run,
+    // and environment, handed to the run (the daemon's own stays as is).
+    std::string cwd;
+    std::vector<std::pair<std::string, std::string>> env;
+    // Absolute --depfile/--outputs paths, empty when not requested.
+    std::string depfile;
+    std::string manifest;
+  };
+
+  // Runs a request inside the daemon and returns its exit status.
+  using handler = std::function<int(const request &)>;
+
+  // $FLATT_SOCKET, else flatt.sock in $XDG_RUNTIME_DIR or in a flatt-<uid>
+  // directory of the temp directory.
+  std::filesystem::path default_socket();
+
+  // Listens on `socket` and handles requests one at a time (runs share the
+  // working directory and logger), forwarding everything logged during a run
+  // to its client. A request arriving during a run is answered busy. Returns
+  // when interrupted, once the current run is over.
+  int serve(const std::filesystem::path &socket, const handler &run);
+
+  // Sends `req` to the daemon listening on `socket` and prints its output.
+  // Returns the run's exit status, or nothing when no daemon answers or it
+  // is busy with another run.
+  std::optional<int> forward(const std::filesystem::path &socket, const request &req);
+
+  // The current process' working directory and environment.
+  request current(std::string project, std::vector<std::string> arguments);
+
+} // namespace server
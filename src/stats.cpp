@@ -0,0 +1,71 @@
+#ifdef _WIN32
+  #include <windows.h>
+  #include <psapi.h>
+#else
+  #include <sys/resource.h>
+#endif
+
+#include <array>
+#include <atomic>
+
+#include "./stats.hpp"
+
+using namespace std;
+
+namespace {
+
+  constexpr auto counters = static_cast<size_t>(stats::counter::count);
+
+  constexpr array<string_view, counters> names = {
+    "files_read",       "bytes_read",          "files_written",   "bytes_written",
+    "files_skipped",    "processes_spawned",   "reflect_calls",   "reflect_cache_hits",
+    "reflect_us",       "templates_parsed",    "template_cache_hits", "hash_cache_hits",
+    "hash_cache_misses",
+  };
+
+  array<atomic<uint64_t>, counters> &values() {
+    static array<atomic<uint64_t>, counters> v{};
+    return v;
+  }
+
+} // namespace
+
+void stats::add(counter which, uint64_t amount) {
+  values()[static_cast<size_t>(which)].fetch_add(amount, memory_order_relaxed);
+}
+
+vector<pair<string_view, uint64_t>> stats::snapshot() {
+  auto result = vector<pair<string_view, uint64_t>>{};
+  result.reserve(counters);
+  for (size_t i = 0; i < counters; i++) {
+    result.emplace_back(names[i], values()[i].load(memory_order_relaxed));
+  }
+  return result;
+}
+
+void stats::reset() {
+  for (auto &value : values()) {
+    value.store(0, memory_order_relaxed);
+  }
+}
+
+uint64_t stats::peak_rss() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS info;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &info, sizeof(info))) {
+    return 0;
+  }
+  return info.PeakWorkingSetSize;
+#else
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  #ifdef __APPLE__
+  return static_cast<uint64_t>(usage.ru_maxrss);
+  #else
+  // kilobytes on Linux and the BSDs
+  return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+  #endif
+#endif
+}
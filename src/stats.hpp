@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace stats {
+
+  enum class counter {
+    files_read,
+    bytes_read,
+    files_written,
+    bytes_written,
+    // outputs of up to date tasks, left as they were
+    files_skipped,
+    processes_spawned,
+    reflect_calls,
+    reflect_cache_hits,
+    // time spent reflecting schemas that weren't cached
+    reflect_us,
+    templates_parsed,
+    template_cache_hits,
+    hash_cache_hits,
+    hash_cache_misses,
+    count,
+  };
+
+  void add(counter which, uint64_t amount = 1);
+
+  // Every counter by name, in declaration order.
+  std::vector<std::pair<std::string_view, uint64_t>> snapshot();
+
+  // Zeroes the counters, e.g. between watch mode or daemon runs.
+  void reset();
+
+  // Highest resident set size of the process so far in bytes, 0 if unknown.
+  uint64_t peak_rss();
+
+} // namespace stats
@@ -1,7 +1,9 @@
 #include <regex>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <algorithm>
 #include <iostream>
 #include <iomanip>
 #include <filesystem>
@@ -13,19 +15,19 @@
 using namespace str;
 using namespace std;
 
-string str::skip(string str, int length) {
+string_view str::skip(string_view str, int length) {
   if (length < 0) {
     return str;
   }
   if (str.length() <= length) {
-    return "";
+    return {};
   }
   return str.substr(str.length() - length);
 }
 
-string str::take(string str, int length) {
+string_view str::take(string_view str, int length) {
   if (length < 0) {
-    return "";
+    return {};
   }
   if (str.length() <= length) {
     return str;
@@ -33,34 +35,31 @@ string str::take(string str, int length) {
   return str.substr(0, length);
 }
 
-string str::first(string str, int length) {
+string_view str::first(string_view str, int length) {
   return take(str, length);
 }
 
-string str::last(string str, int length) {
-  return skip(str, str.length() - length);
+string_view str::last(string_view str, int length) {
+  return skip(str, static_cast<int>(str.length()) - length);
 }
 
-bool str::ends_with(const string str, const string subject) {
-  if (subject.length() > str.length())
-    return false;
-  return equal(subject.rbegin(), subject.rend(), str.rbegin());
+bool str::ends_with(string_view str, string_view subject) {
+  return str.ends_with(subject);
 }
 
-bool str::starts_with(const string value, const string subject) {
-  if (subject.length() > value.length())
-    return false;
-  return equal(subject.begin(), subject.end(), value.begin());
+bool str::starts_with(string_view value, string_view subject) {
+  return value.starts_with(subject);
 }
 
-string str::replace_all(string data, string find, string replacement) {
-  auto dot = regex("(.*)?" + find + "(.*)?");
+string str::replace_all(string_view data, string_view find, string_view replacement) {
+  auto dot = regex("(.*)?" + string(find) + "(.*)?");
+  auto format = "$1" + string(replacement) + "$2";
 
   auto current = string(data);
   while (true) {
-    auto replaced = regex_replace(current, dot, "$1" + replacement + "$2");
+    auto replaced = regex_replace(current, dot, format);
     if (replaced != current) {
-      current = replaced;
+      current = move(replaced);
       continue;
     }
     break;
@@ -69,59 +68,76 @@ string str::replace_all(string data, string find, string replacement) {
   return current;
 }
 
-vector<string> str::split(string value, char delimiter) {
-  auto result = vector<string>();
-  stringstream stream(value);
-  for (string token; std::getline(stream, token, delimiter);) {
-    result.push_back(move(token));
+vector<string_view> str::split(string_view value, char delimiter) {
+  auto result = vector<string_view>();
+  size_t last = 0;
+  size_t next = 0;
+  while ((next = value.find(delimiter, last)) != string_view::npos) {
+    result.push_back(value.substr(last, next - last));
+    last = next + 1;
+  }
+  if (last < value.size()) {
+    result.push_back(value.substr(last));
   }
   return result;
 }
 
-vector<string> str::split(string value, vector<char> delimiter) {
-  auto result = vector<string>();
-  auto current = ""s;
-  for (size_t i = 0; i < value.size(); i++) {
-    auto split = false;
-    auto character = value[i];
-    for (auto test : delimiter) {
-      if (character == test) {
-        result.push_back(current);
-        current = "";
-        split = true;
-        break;
-      }
-    }
-    if (!split) {
-      current += character;
-    }
+vector<string_view> str::split(string_view value, const vector<char> &delimiter) {
+  auto result = vector<string_view>();
+  auto delimiters = string_view(delimiter.data(), delimiter.size());
+  size_t last = 0;
+  size_t next = 0;
+  while ((next = value.find_first_of(delimiters, last)) != string_view::npos) {
+    result.push_back(value.substr(last, next - last));
+    last = next + 1;
   }
-  if (current != "") {
-    result.push_back(current);
+  if (last < value.size()) {
+    result.push_back(value.substr(last));
   }
   return result;
 }
 
-string str::padleft(string value, int length, string pad) {
-  for (auto i = 0; i < value.length() - length; i++) {
-    value = pad + value;
+static string pad_to(string_view value, int length, string_view pad, bool left) {
+  if (pad.empty() || length <= 0 || value.length() >= static_cast<size_t>(length)) {
+    return string(value);
   }
-  return value;
-}
 
-string str::padright(string value, int length, string pad) {
-  for (auto i = 0; i < value.length() - length; i++) {
-    value = value + pad;
+  auto fill = static_cast<size_t>(length) - value.length();
+  auto result = string();
+  result.reserve(length);
+
+  if (!left) {
+    result.append(value);
+  }
+  for (size_t i = 0; i < fill; i++) {
+    result.push_back(pad[i % pad.size()]);
   }
-  return value;
+  if (left) {
+    result.append(value);
+  }
+
+  return result;
 }
 
-vector<string> str::split(string value, string delimiter, int limit) {
+string str::padleft(string_view value, int length, string_view pad) {
+  return pad_to(value, length, pad, true);
+}
+
+string str::padright(string_view value, int length, string_view pad) {
+  return pad_to(value, length, pad, false);
+}
+
+vector<string_view> str::split(string_view value, string_view delimiter, int limit) {
   size_t last = 0;
   size_t next = 0;
-  auto result = vector<string>{};
+  auto result = vector<string_view>{};
+
+  if (delimiter.empty()) {
+    result.push_back(value);
+    return result;
+  }
 
-  while ((next = value.find(delimiter, last)) != string::npos) {
+  while ((next = value.find(delimiter, last)) != string_view::npos) {
     result.push_back(value.substr(last, next - last));
     last = next + delimiter.length();
     auto count = result.size() + (value.length() > 0 ? 1 : 0);
@@ -134,7 +150,7 @@ vector<string> str::split(string value, string delimiter, int limit) {
   return result;
 }
 
-vector<string> str::tokenize(string value) {
+vector<string> str::tokenize(string_view value) {
   auto words = split(value, vector<char>{ ' ', '-', '_', '|', '/', '\\', '.' });
   auto parts = vector<string>{};
 
@@ -176,23 +192,38 @@ vector<string> str::tokenize(string value) {
   return parts;
 }
 
-string str::join(const vector<string> parts, const string &delim) {
-  ostringstream joined;
+template <typename T>
+static string join_parts(const vector<T> &parts, string_view delim) {
+  if (parts.empty()) {
+    return {};
+  }
 
-  auto b = begin(parts), e = end(parts);
-  if (b != e) {
-    copy(b, prev(e), ostream_iterator<string>(joined, delim.c_str()));
-    b = prev(e);
+  auto size = delim.size() * (parts.size() - 1);
+  for (const auto &part : parts) {
+    size += part.size();
   }
 
-  if (b != e) {
-    joined << *b;
+  auto joined = string();
+  joined.reserve(size);
+  for (size_t i = 0; i < parts.size(); i++) {
+    if (i > 0) {
+      joined.append(delim);
+    }
+    joined.append(parts[i]);
   }
 
-  return joined.str();
+  return joined;
+}
+
+string str::join(const vector<string> &parts, string_view delim) {
+  return join_parts(parts, delim);
 }
 
-string str::to_lower(const string &value) {
+string str::join(const vector<string_view> &parts, string_view delim) {
+  return join_parts(parts, delim);
+}
+
+string str::to_lower(string_view value) {
   auto data = string(value);
   transform(data.begin(), data.end(), data.begin(), [](auto c) {
     return tolower(c);
@@ -200,7 +231,7 @@ string str::to_lower(const string &value) {
   return data;
 }
 
-string str::to_upper(const string &value) {
+string str::to_upper(string_view value) {
   auto data = string(value);
   transform(data.begin(), data.end(), data.begin(), [](auto c) {
     return toupper(c);
@@ -208,23 +239,23 @@ string str::to_upper(const string &value) {
   return data;
 }
 
-string str::to_upper_first(const string &value) {
+string str::to_upper_first(string_view value) {
   auto data = string(value);
   if (data.size() >= 1) {
-    return (char)toupper(data[0]) + data.substr(1);
+    data[0] = (char)toupper(data[0]);
   }
   return data;
 }
 
-string str::to_lower_first(const string &value) {
+string str::to_lower_first(string_view value) {
   auto data = string(value);
   if (data.size() >= 1) {
-    return (char)tolower(data[0]) + data.substr(1);
+    data[0] = (char)tolower(data[0]);
   }
   return data;
 }
 
-string str::to_snake(const string &value) {
+string str::to_snake(string_view value) {
   auto parts = tokenize(value);
   transform(parts.begin(), parts.end(), parts.begin(), [](auto &word) {
     return to_lower(word);
@@ -232,7 +263,7 @@ string str::to_snake(const string &value) {
   return join(parts, "_");
 }
 
-string str::to_kebab(const string &value) {
+string str::to_kebab(string_view value) {
   auto parts = tokenize(value);
   transform(parts.begin(), parts.end(), parts.begin(), [](auto &word) {
     return to_lower(word);
@@ -240,7 +271,7 @@ string str::to_kebab(const string &value) {
   return join(parts, "-");
 }
 
-string str::to_pascal(const string &value) {
+string str::to_pascal(string_view value) {
   auto parts = tokenize(value);
   transform(parts.begin(), parts.end(), parts.begin(), [](auto &word) {
     return to_upper_first(to_lower(word));
@@ -248,7 +279,7 @@ string str::to_pascal(const string &value) {
   return join(parts, "");
 }
 
-string str::to_camel(const string &value) {
+string str::to_camel(string_view value) {
   auto parts = tokenize(value);
   transform(parts.begin(), parts.end(), parts.begin(), [](auto &word) {
     return to_upper_first(to_lower(word));
@@ -256,7 +287,7 @@ string str::to_camel(const string &value) {
   return to_lower_first(str::join(parts, ""));
 }
 
-string str::to_const(const string &value) {
+string str::to_const(string_view value) {
   auto parts = tokenize(value);
   transform(parts.begin(), parts.end(), parts.begin(), [](auto &word) {
     return str::to_upper(word);
@@ -264,7 +295,7 @@ string str::to_const(const string &value) {
   return str::join(parts, "_");
 }
 
-string str::to_train(const string &value) {
+string str::to_train(string_view value) {
   auto parts = tokenize(value);
   transform(parts.begin(), parts.end(), parts.begin(), [](auto &word) {
     return to_upper_first(to_lower(word));
@@ -272,7 +303,7 @@ string str::to_train(const string &value) {
   return join(parts, "-");
 }
 
-string str::to_ada(const string &value) {
+string str::to_ada(string_view value) {
   auto parts = tokenize(value);
   transform(parts.begin(), parts.end(), parts.begin(), [](auto &word) {
     return to_upper_first(to_lower(word));
@@ -280,7 +311,7 @@ string str::to_ada(const string &value) {
   return join(parts, "_");
 }
 
-string str::to_cobol(const string &value) {
+string str::to_cobol(string_view value) {
   auto parts = tokenize(value);
   transform(parts.begin(), parts.end(), parts.begin(), [](auto &word) {
     return to_upper(word);
@@ -288,19 +319,19 @@ string str::to_cobol(const string &value) {
   return join(parts, "-");
 }
 
-string str::to_dot(const string &value) {
+string str::to_dot(string_view value) {
   return join(tokenize(value), ".");
 }
 
-string str::to_path(const string &value) {
+string str::to_path(string_view value) {
   return join(tokenize(value), "/");
 }
 
-string str::to_space(const string &value) {
+string str::to_space(string_view value) {
   return join(tokenize(value), " ");
 }
 
-string str::to_capital(const string &value) {
+string str::to_capital(string_view value) {
   auto parts = tokenize(value);
   transform(parts.begin(), parts.end(), parts.begin(), [](auto &word) {
     return to_upper_first(to_lower(word));
@@ -308,7 +339,7 @@ string str::to_capital(const string &value) {
   return join(parts, " ");
 }
 
-string str::to_cpp(const string &value) {
+string str::to_cpp(string_view value) {
   auto parts = tokenize(value);
   transform(parts.begin(), parts.end(), parts.begin(), [](auto &word) {
     return to_lower(word);
@@ -316,84 +347,173 @@ string str::to_cpp(const string &value) {
   return join(parts, "::");
 }
 
+string_view str::trim_left_view(string_view s) {
+  auto it = find_if(s.begin(), s.end(), [](unsigned char ch) {
+    return !isspace(ch);
+  });
+  return s.substr(it - s.begin());
+}
+
+string_view str::trim_left_view(string_view s, string_view chars) {
+  auto start = s.find_first_not_of(chars);
+  return start == string_view::npos ? string_view{} : s.substr(start);
+}
+
+string_view str::trim_right_view(string_view s) {
+  auto it = find_if(s.rbegin(), s.rend(), [](unsigned char ch) {
+    return !isspace(ch);
+  });
+  return s.substr(0, s.rend() - it);
+}
+
+string_view str::trim_right_view(string_view s, string_view chars) {
+  auto end = s.find_last_not_of(chars);
+  return end == string_view::npos ? string_view{} : s.substr(0, end + 1);
+}
+
+string_view str::trim_view(string_view s) {
+  return trim_right_view(trim_left_view(s));
+}
+
+string_view str::trim_view(string_view s, string_view chars) {
+  return trim_right_view(trim_left_view(s, chars), chars);
+}
+
 void str::trim_left(string &s) {
-  s.erase(s.begin(), find_if(s.begin(), s.end(), [](unsigned char ch) {
-            return !isspace(ch);
-          }));
+  s.erase(0, s.size() - trim_left_view(s).size());
 }
 
-void str::trim_left(string &s, string chars) {
-  s.erase(s.begin(), find_if(s.begin(), s.end(), [&](unsigned char ch) {
-            return chars.find(ch) != string::npos;
-          }));
+void str::trim_left(string &s, string_view chars) {
+  s.erase(0, s.size() - trim_left_view(s, chars).size());
 }
 
 void str::trim_right(string &s) {
-  s.erase(
-    find_if(
-      s.rbegin(), s.rend(),
-      [](unsigned char ch) {
-        return !isspace(ch);
-      })
-      .base(),
-    s.end());
-}
-
-void str::trim_right(string &s, string chars) {
-  s.erase(
-    find_if(
-      s.rbegin(), s.rend(),
-      [&](unsigned char ch) {
-        return chars.find(ch) != string::npos;
-      })
-      .base(),
-    s.end());
+  s.resize(trim_right_view(s).size());
+}
+
+void str::trim_right(string &s, string_view chars) {
+  s.resize(trim_right_view(s, chars).size());
 }
 
 void str::trim(string &s) {
-  trim_left(s);
   trim_right(s);
+  trim_left(s);
 }
 
-void str::trim(string &s, string &chars) {
-  trim_left(s, chars);
+void str::trim(string &s, string_view chars) {
   trim_right(s, chars);
+  trim_left(s, chars);
 }
 
-string str::trim_left_copy(string s) {
-  trim_left(s);
-  return s;
+string str::trim_left_copy(string_view s) {
+  return string(trim_left_view(s));
 }
 
-string str::trim_left_copy(string s, string chars) {
-  trim_left(s, chars);
-  return s;
+string str::trim_left_copy(string_view s, string_view chars) {
+  return string(trim_left_view(s, chars));
 }
 
-string str::trim_right_copy(string s) {
-  trim_right(s);
-  return s;
+string str::trim_right_copy(string_view s) {
+  return string(trim_right_view(s));
 }
 
-string str::trim_right_copy(string s, string chars) {
-  trim_right(s, chars);
-  return s;
+string str::trim_right_copy(string_view s, string_view chars) {
+  return string(trim_right_view(s, chars));
 }
 
-string str::trim_copy(string s) {
-  trim(s);
-  return s;
+string str::trim_copy(string_view s) {
+  return string(trim_view(s));
 }
 
-string str::trim_copy(string s, string chars) {
-  trim(s, chars);
-  return s;
+string str::trim_copy(string_view s, string_view chars) {
+  return string(trim_view(s, chars));
 }
 
-vector<string> str::parse_tags(string value, char delimiter) {
-  auto parts = split(value, ',');
-  transform(parts.begin(), parts.end(), parts.begin(), [](auto &word) {
-    return trim_copy(word);
+vector<string_view> str::parse_tags(string_view value, char delimiter) {
+  auto parts = split(value, delimiter);
+  transform(parts.begin(), parts.end(), parts.begin(), [](auto word) {
+    return trim_view(word);
   });
   return parts;
 }
+
+bool str::glob_match(string_view pattern, string_view value) {
+  size_t p = 0;
+  size_t v = 0;
+
+  while (p < pattern.size()) {
+    auto token = pattern[p];
+
+    if (token == '*') {
+      if (p + 1 < pattern.size() && pattern[p + 1] == '*') {
+        p += 2;
+        // "**/" may also match no directory at all
+        if (p < pattern.size() && pattern[p] == '/' && glob_match(pattern.substr(p + 1), value.substr(v))) {
+          return true;
+        }
+        for (auto k = v; k <= value.size(); k++) {
+          if (glob_match(pattern.substr(p), value.substr(k))) {
+            return true;
+          }
+        }
+        return false;
+      }
+
+      p += 1;
+      for (auto k = v; k <= value.size(); k++) {
+        if (glob_match(pattern.substr(p), value.substr(k))) {
+          return true;
+        }
+        if (k < value.size() && value[k] == '/') {
+          break;
+        }
+      }
+      return false;
+    }
+
+    if (v >= value.size()) {
+      return false;
+    }
+
+    if (token == '?') {
+      if (value[v] == '/') {
+        return false;
+      }
+    } else if (token == '[') {
+      auto close = pattern.find(']', p + 2);
+      if (close == string_view::npos) {
+        if (value[v] != token) {
+          return false;
+        }
+      } else {
+        auto set = pattern.substr(p + 1, close - p - 1);
+        auto negate = set[0] == '!' || set[0] == '^';
+        if (negate) {
+          set.remove_prefix(1);
+        }
+
+        auto found = false;
+        for (size_t i = 0; i < set.size(); i++) {
+          if (i + 2 < set.size() && set[i + 1] == '-') {
+            found = found || (value[v] >= set[i] && value[v] <= set[i + 2]);
+            i += 2;
+          } else {
+            found = found || value[v] == set[i];
+          }
+        }
+
+        if (found == negate || value[v] == '/') {
+          return false;
+        }
+        p = close;
+      }
+    } else if (token != value[v]) {
+      return false;
+    }
+
+    p += 1;
+    v += 1;
+  }
+
+  return v == value.size();
+}
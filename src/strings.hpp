@@ -1,65 +1,78 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <sstream>
 #include <vector>
 #include <iomanip>
 
 namespace str {
 
-  std::string skip(std::string str, int length);
+  // Functions returning `std::string_view` (or vectors of them) point into
+  // their input and must not outlive it.
 
-  std::string take(std::string str, int length);
+  std::string_view skip(std::string_view str, int length);
 
-  std::string first(std::string str, int length);
-  std::string last(std::string str, int length);
+  std::string_view take(std::string_view str, int length);
 
-  bool ends_with(const std::string str, const std::string subject);
-  bool starts_with(const std::string value, const std::string subject);
+  std::string_view first(std::string_view str, int length);
+  std::string_view last(std::string_view str, int length);
 
-  std::string replace_all(std::string data, std::string find, std::string replacement);
+  bool ends_with(std::string_view str, std::string_view subject);
+  bool starts_with(std::string_view value, std::string_view subject);
 
-  std::vector<std::string> split(std::string value, char delimiter = ' ');
-  std::vector<std::string> split(std::string value, std::vector<char> delimiter = { ' ' });
+  std::string replace_all(std::string_view data, std::string_view find, std::string_view replacement);
 
-  std::string padleft(std::string value, int length, std::string pad = " ");
-  std::string padright(std::string value, int length, std::string pad = " ");
+  std::vector<std::string_view> split(std::string_view value, char delimiter = ' ');
+  std::vector<std::string_view> split(std::string_view value, const std::vector<char> &delimiter);
 
-  std::vector<std::string> split(std::string value, std::string delimiter, int limit = 0);
-  std::vector<std::string> tokenize(std::string value);
+  std::string padleft(std::string_view value, int length, std::string_view pad = " ");
+  std::string padright(std::string_view value, int length, std::string_view pad = " ");
 
-  std::string join(const std::vector<std::string> parts, const std::string &delim);
+  std::vector<std::string_view> split(std::string_view value, std::string_view delimiter, int limit = 0);
+  std::vector<std::string> tokenize(std::string_view value);
 
-  std::string to_lower(const std::string &value);
-  std::string to_lower_first(const std::string &value);
-  std::string to_upper(const std::string &value);
-  std::string to_upper_first(const std::string &value);
-  std::string to_snake(const std::string &value);
-  std::string to_kebab(const std::string &value);
-  std::string to_pascal(const std::string &value);
-  std::string to_camel(const std::string &value);
-  std::string to_const(const std::string &value);
-  std::string to_train(const std::string &value);
-  std::string to_ada(const std::string &value);
-  std::string to_cobol(const std::string &value);
-  std::string to_dot(const std::string &value);
-  std::string to_path(const std::string &value);
-  std::string to_space(const std::string &value);
-  std::string to_capital(const std::string &value);
-  std::string to_cpp(const std::string &value);
+  std::string join(const std::vector<std::string> &parts, std::string_view delim);
+  std::string join(const std::vector<std::string_view> &parts, std::string_view delim);
+
+  std::string to_lower(std::string_view value);
+  std::string to_lower_first(std::string_view value);
+  std::string to_upper(std::string_view value);
+  std::string to_upper_first(std::string_view value);
+  std::string to_snake(std::string_view value);
+  std::string to_kebab(std::string_view value);
+  std::string to_pascal(std::string_view value);
+  std::string to_camel(std::string_view value);
+  std::string to_const(std::string_view value);
+  std::string to_train(std::string_view value);
+  std::string to_ada(std::string_view value);
+  std::string to_cobol(std::string_view value);
+  std::string to_dot(std::string_view value);
+  std::string to_path(std::string_view value);
+  std::string to_space(std::string_view value);
+  std::string to_capital(std::string_view value);
+  std::string to_cpp(std::string_view value);
+
+  std::string_view trim_left_view(std::string_view s);
+  std::string_view trim_left_view(std::string_view s, std::string_view chars);
+  std::string_view trim_right_view(std::string_view s);
+  std::string_view trim_right_view(std::string_view s, std::string_view chars);
+  std::string_view trim_view(std::string_view s);
+  std::string_view trim_view(std::string_view s, std::string_view chars);
 
   void trim_left(std::string &s);
-  void trim_left(std::string &s, std::string chars);
+  void trim_left(std::string &s, std::string_view chars);
   void trim_right(std::string &s);
-  void trim_right(std::string &s, std::string chars);
+  void trim_right(std::string &s, std::string_view chars);
   void trim(std::string &s);
-  void trim(std::string &s, std::string &chars);
+  void trim(std::string &s, std::string_view chars);
 
-  std::string trim_left_copy(std::string s);
-  std::string trim_left_copy(std::string s, std::string chars);
-  std::string trim_right_copy(std::string s);
-  std::string trim_right_copy(std::string s, std::string chars);
-  std::string trim_copy(std::string s);
-  std::string trim_copy(std::string s, std::string chars);
+  std::string trim_left_copy(std::string_view s);
+  std::string trim_left_copy(std::string_view s, std::string_view chars);
+  std::string trim_right_copy(std::string_view s);
+  std::string trim_right_copy(std::string_view s, std::string_view chars);
+  std::string trim_copy(std::string_view s);
+  std::string trim_copy(std::string_view s, std::string_view chars);
 
   template <typename T>
   std::string to_hex(T v, T size = sizeof(T) * 2, std::string fill = "0", std::string prefix = "0x") {
@@ -68,6 +81,10 @@ namespace str {
     return prefix + stream.str();
   }
 
-  std::vector<std::string> parse_tags(std::string value, char delimiter = ',');
+  std::vector<std::string_view> parse_tags(std::string_view value, char delimiter = ',');
+
+  // Shell-style matching on '/' separated paths: `*` and `?` stay within a
+  // segment, `**` spans segments and `[...]`/`[!...]` match a character set.
+  bool glob_match(std::string_view pattern, std::string_view value);
 
 } // namespace str
@@ -0,0 +1,411 @@
+#ifdef _WIN32
+  #include <process.h>
+#else
+  #include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <unordered_map>
+
+#include <spdlog/spdlog.h>
+
+#include "./async.hpp"
+#include "./hash.hpp"
+#include "./io.hpp"
+#include "./output.hpp"
+#include "./output_cache.hpp"
+#include "./stats.hpp"
+#include "./strings.hpp"
+#include "./tasks.hpp"
+
+using namespace std;
+using namespace std::filesystem;
+
+namespace {
+
+  enum class progress {
+    pending,
+    running,
+    done,
+    failed,
+  };
+
+  bool is_pattern(string_view name) {
+    return name.find_first_of("*?[") != string_view::npos;
+  }
+
+  string normalize(string_view name) {
+    return path(name).lexically_normal().generic_string();
+  }
+
+  // Keys shared through the output cache must not depend on where the
+  // project is checked out.
+  string portable(string_view name) {
+    return path(name).lexically_normal().lexically_proximate(current_path()).generic_string();
+  }
+
+  // Same rule as `expand`: the pattern matches the whole path relative to
+  // the project, `*` doesn't cross directories.
+  bool produces(const tasks::task &producer, const string &input) {
+    auto wanted = portable(input);
+    for (auto &output : producer.outputs) {
+      auto name = portable(output);
+      if (is_pattern(input) ? str::glob_match(wanted, name) : wanted == name) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Patterns are walked from their longest directory prefix without
+  // wildcards, and match the whole path (the walker alone would match a
+  // slash-less pattern against names at any depth).
+  optional<vector<string>> expand(const vector<string> &inputs) {
+    auto files = vector<string>{};
+    for (auto &input : inputs) {
+      if (!is_pattern(input)) {
+        if (!exists(input) && !output::pending(input)) {
+          spdlog::error("Missing input: {}", input);
+          return {};
+        }
+        files.push_back(normalize(input));
+        continue;
+      }
+
+      auto pattern = normalize(input);
+      auto wildcard = pattern.find_first_of("*?[");
+      auto slash = pattern.rfind('/', wildcard);
+      auto base = slash == string::npos ? string() : pattern.substr(0, slash + 1);
+
+      // no deeper than the pattern's own directories unless it has a `**`
+      auto depth = pattern.find("**") == string::npos
+                     ? static_cast<int>(count(pattern.begin() + base.size(), pattern.end(), '/'))
+                     : -1;
+
+      auto it = io::walker(base.empty() ? path(".") : path(base), { .max_depth = depth }, base);
+      for (auto entry = it.next(); entry.has_value(); entry = it.next()) {
+        if (str::glob_match(pattern, entry.value())) {
+          files.push_back(move(entry.value()));
+        }
+      }
+    }
+
+    sort(files.begin(), files.end());
+    files.erase(unique(files.begin(), files.end()), files.end());
+    return files;
+  }
+
+  optional<string> digest(const tasks::task &t, const vector<string> &inputs, const string &salt) {
+    auto hasher = hashes::stream(hashes::algorithm::xxh3);
+    hasher.update(salt);
+    hasher.update("inputs\n");
+    for (auto &input : inputs) {
+      auto current = io::hash_file(input, hashes::algorithm::xxh3);
+      if (!current.has_value()) {
+        spdlog::error("Unable to hash input of {}: {}", t.name, input);
+        return {};
+      }
+      hasher.update(portable(input));
+      hasher.update(string_view("\0", 1));
+      hasher.update(current.value());
+      hasher.update("\n");
+    }
+    hasher.update("outputs\n");
+    for (auto &output : t.outputs) {
+      hasher.update(portable(output));
+      hasher.update("\n");
+    }
+    hasher.update("version\n");
+    hasher.update(t.version);
+    hasher.update("\ncommand\n");
+    for (auto &argument : t.command) {
+      hasher.update(argument);
+      hasher.update(string_view("\0", 1));
+    }
+    return hasher.digest();
+  }
+
+  // "<digest> <name>" per line
+  map<string, string> load(const path &file) {
+    auto entries = map<string, string>{};
+    ifstream ifs(file, ios::binary);
+    string line;
+    while (getline(ifs, line)) {
+      auto space = line.find(' ');
+      if (space != string::npos) {
+        entries[line.substr(space + 1)] = line.substr(0, space);
+      }
+    }
+    return entries;
+  }
+
+  bool save(const path &file, const map<string, string> &entries) {
+    error_code ec;
+    create_directories(file.parent_path(), ec);
+
+#ifdef _WIN32
+    auto pid = _getpid();
+#else
+    auto pid = getpid();
+#endif
+    // other flatt processes of the project (parallel build edges) save too
+    static auto saves = atomic<unsigned>{ 0 };
+    auto temp = file;
+    temp += "." + to_string(pid) + "." + to_string(saves++) + ".tmp";
+    {
+      ofstream ofs(temp, ios::binary | ios::trunc);
+      for (auto &[name, value] : entries) {
+        ofs << value << ' ' << name << '\n';
+      }
+      if (!ofs.good()) {
+        ofs.close();
+        remove(temp, ec);
+        return false;
+      }
+    }
+
+    rename(temp, file, ec);
+    if (ec) {
+      remove(temp, ec);
+      return false;
+    }
+    return true;
+  }
+
+  bool outputs_exist(const tasks::task &t) {
+    return all_of(t.outputs.begin(), t.outputs.end(), [](const string &output) {
+      return output::pending(output) || exists(output);
+    });
+  }
+
+} // namespace
+
+optional<tasks::summary> tasks::build(
+  const vector<task> &graph, const path &manifest, unordered_map<string, bool> &finished, const string &salt) {
+  auto index = unordered_map<string, size_t>{};
+  for (size_t i = 0; i < graph.size(); i++) {
+    if (!index.emplace(graph[i].name, i).second) {
+      spdlog::error("Duplicate task: {}", graph[i].name);
+      return {};
+    }
+  }
+
+  // edges point from a task to the ones it waits for
+  auto waits = vector<vector<size_t>>(graph.size());
+  for (size_t i = 0; i < graph.size(); i++) {
+    for (auto &dep : graph[i].deps) {
+      auto found = index.find(dep);
+      if (found == index.end()) {
+        spdlog::error("Task {} depends on unknown task {}", graph[i].name, dep);
+        return {};
+      }
+      waits[i].push_back(found->second);
+    }
+    for (auto &input : graph[i].inputs) {
+      for (size_t j = 0; j < graph.size(); j++) {
+        if (j != i && produces(graph[j], input)) {
+          waits[i].push_back(j);
+        }
+      }
+    }
+  }
+
+  // Kahn's algorithm, only to reject cycles before running anything
+  {
+    auto blocking = vector<size_t>(graph.size());
+    auto unblocks = vector<vector<size_t>>(graph.size());
+    for (size_t i = 0; i < graph.size(); i++) {
+      blocking[i] = waits[i].size();
+      for (auto j : waits[i]) {
+        unblocks[j].push_back(i);
+      }
+    }
+
+    auto ready = vector<size_t>{};
+    for (size_t i = 0; i < graph.size(); i++) {
+      if (blocking[i] == 0) {
+        ready.push_back(i);
+      }
+    }
+
+    auto visited = size_t{ 0 };
+    while (!ready.empty()) {
+      auto current = ready.back();
+      ready.pop_back();
+      visited++;
+      for (auto next : unblocks[current]) {
+        if (--blocking[next] == 0) {
+          ready.push_back(next);
+        }
+      }
+    }
+
+    if (visited != graph.size()) {
+      spdlog::error("The task graph has a cycle");
+      return {};
+    }
+  }
+
+  auto recorded = load(manifest);
+  auto result = summary{};
+  auto states = vector<progress>(graph.size(), progress::pending);
+  auto digests = vector<string>(graph.size());
+  auto cache_keys = vector<string>(graph.size());
+  auto running = vector<pair<size_t, vector<shared_ptr<process::job>>>>{};
+
+  for (size_t i = 0; i < graph.size(); i++) {
+    auto earlier = finished.find(graph[i].name);
+    if (earlier != finished.end()) {
+      states[i] = earlier->second ? progress::done : progress::failed;
+    }
+  }
+
+  auto finish = [&](size_t i, bool ok) {
+    if (ok && !outputs_exist(graph[i])) {
+      spdlog::error("Task {} didn't produce all of its outputs", graph[i].name);
+      ok = false;
+    }
+
+    states[i] = ok ? progress::done : progress::failed;
+    if (ok) {
+      if (!cache_keys[i].empty()) {
+        output_cache::store(cache_keys[i], graph[i].outputs);
+      }
+      recorded[graph[i].name] = digests[i];
+      result.ran++;
+    } else {
+      recorded.erase(graph[i].name);
+      result.failed++;
+    }
+  };
+
+  auto start = [&](size_t i) {
+    auto &t = graph[i];
+
+    auto inputs = expand(t.inputs);
+    auto current = inputs.has_value() ? digest(t, inputs.value(), salt) : nullopt;
+    if (!current.has_value()) {
+      states[i] = progress::failed;
+      result.failed++;
+      return;
+    }
+
+    auto previous = recorded.find(t.name);
+    if (previous != recorded.end() && previous->second == current.value() && outputs_exist(t)) {
+      spdlog::debug("Task {} is up to date", t.name);
+      states[i] = progress::done;
+      result.skipped++;
+      stats::add(stats::counter::files_skipped, t.outputs.size());
+      return;
+    }
+
+    digests[i] = move(current.value());
+
+    if (output_cache::enabled() && !t.outputs.empty()) {
+      cache_keys[i] = hashes::xxh128(salt + '\n' + digests[i]);
+      if (output_cache::restore(cache_keys[i], t.outputs)) {
+        spdlog::info("Restored task {} from the output cache", t.name);
+        recorded[t.name] = digests[i];
+        states[i] = progress::done;
+        result.restored++;
+        return;
+      }
+    }
+
+    spdlog::info("Running task {}", t.name);
+
+    auto started = t.run ? t.run(t, inputs.value()) : outcome{};
+    if (!started.ok || started.jobs.empty()) {
+      finish(i, started.ok);
+      return;
+    }
+
+    states[i] = progress::running;
+    running.emplace_back(i, move(started.jobs));
+  };
+
+  while (true) {
+    auto progressed = false;
+
+    for (size_t i = 0; i < graph.size(); i++) {
+      if (states[i] != progress::pending) {
+        continue;
+      }
+
+      auto blocked = false;
+      auto failed = false;
+      for (auto j : waits[i]) {
+        blocked = blocked || states[j] == progress::pending || states[j] == progress::running;
+        failed = failed || states[j] == progress::failed;
+      }
+      if (blocked) {
+        continue;
+      }
+
+      progressed = true;
+      if (failed) {
+        spdlog::error("Task {} skipped, a dependency failed", graph[i].name);
+        states[i] = progress::failed;
+        result.failed++;
+        continue;
+      }
+      start(i);
+    }
+
+    auto finished = [](const vector<shared_ptr<process::job>> &jobs) {
+      return all_of(jobs.begin(), jobs.end(), [](auto &job) {
+        return job->done();
+      });
+    };
+
+    for (auto it = running.begin(); it != running.end();) {
+      if (!finished(it->second)) {
+        ++it;
+        continue;
+      }
+
+      auto ok = true;
+      for (auto &job : it->second) {
+        auto &current = job->wait();
+        if (current.status != 0) {
+          ok = false;
+          spdlog::error("Task {} failed with status {}", graph[it->first].name, current.status);
+          if (!current.err.empty()) {
+            spdlog::error("{}", current.err);
+          }
+        }
+      }
+
+      finish(it->first, ok);
+      it = running.erase(it);
+      progressed = true;
+    }
+
+    if (running.empty() && !progressed) {
+      break;
+    }
+    // sleeps until a job finishes, process jobs notify when they do
+    if (!progressed) {
+      auto checks = vector<function<bool()>>{};
+      for (auto &[i, jobs] : running) {
+        checks.push_back([&finished, &jobs]() {
+          return finished(jobs);
+        });
+      }
+      async::wait_any(checks);
+    }
+  }
+
+  if (!save(manifest, recorded)) {
+    spdlog::warn("Unable to save the task manifest: {}", manifest.string());
+  }
+
+  for (size_t i = 0; i < graph.size(); i++) {
+    finished[graph[i].name] = states[i] == progress::done;
+  }
+
+  return result;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "./process.hpp"
+
+namespace tasks {
+
+  struct outcome {
+    bool ok = true;
+    // Work still running when `run` returned; the task finishes with it and
+    // fails if any of them exits with a non zero status.
+    std::vector<std::shared_ptr<process::job>> jobs;
+  };
+
+  struct task {
+    std::string name;
+    // Files or glob patterns (see str::glob_match), relative to the working directory.
+    std::vector<std::string> inputs;
+    std::vector<std::string> outputs;
+    // Tasks that must finish first, on top of the ones producing an input.
+    std::vector<std::string> deps;
+    // Part of the up-to-date check, for changes to `run` the inputs can't show.
+    std::string version;
+    // Program and arguments of a command task, part of the up-to-date check.
+    std::vector<std::string> command;
+    // Called on the building thread with the expanded inputs.
+    std::function<outcome(const task &, const std::vector<std::string> &inputs)> run;
+  };
+
+  struct summary {
+    size_t ran = 0;
+    size_t skipped = 0;
+    size_t restored = 0;
+    size_t failed = 0;
+  };
+
+  // Runs the graph in dependency order. A task is skipped when the digest of
+  // `salt` (what else `run` depends on, e.g. the script's sources) and its
+  // inputs, outputs, version and command matches the one recorded in
+  // `manifest` by its last successful run and its outputs exist. While the
+  // jobs of started tasks run on the process pool, every other ready task is
+  // started. Returns nothing when the graph is invalid (unknown dependency,
+  // duplicate name or cycle).
+  //
+  // `finished` holds the tasks of earlier builds of the graph, by name, with
+  // whether they succeeded. They aren't run again, and this build's tasks
+  // are added.
+  //
+  // With the output cache enabled, a task that isn't up to date first tries
+  // to restore its outputs from the entry keyed by its digest, and
+  // successful runs are stored there.
+  std::optional<summary> build(
+    const std::vector<task> &graph, const std::filesystem::path &manifest,
+    std::unordered_map<std::string, bool> &finished, const std::string &salt = "");
+
+} // namespace tasks
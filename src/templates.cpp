@@ -1,17 +1,26 @@
 #include <iomanip>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 #include <spdlog/spdlog.h>
 
+#include "./stats.hpp"
 #include "./strings.hpp"
 #include "./templates.hpp"
+#include "./trace.hpp"
 
 using namespace std;
 using namespace nlohmann;
 using namespace inja;
 
+static string_view string_arg(Arguments &args, size_t index) {
+  return args[index]->get_ref<const json::string_t &>();
+}
+
 json templates::unique(Arguments &args) {
   auto result = json::array({});
-  auto prop = *args[0];
+  auto prop = string_arg(args, 0);
   auto values = *args[1];
 
   auto parts = str::split(prop, '.');
@@ -60,7 +69,7 @@ json templates::filter(Arguments &args, bool invert) {
       return result;
     }
 
-    auto prop = *args[1];
+    auto prop = string_arg(args, 1);
     auto parts = str::split(prop, '.');
     for (auto value : values) {
       auto matches = true;
@@ -81,7 +90,7 @@ json templates::filter(Arguments &args, bool invert) {
     }
   } else if (args.size() == 3) {
     auto entries = *args[0];
-    auto prop = *args[1];
+    auto prop = string_arg(args, 1);
     auto value = *args[2];
 
     if (!entries.is_array()) {
@@ -230,88 +239,88 @@ json templates::merge(Arguments &args) {
 }
 
 json templates::to_ada(Arguments &args) {
-  return str::to_ada(*args[0]);
+  return str::to_ada(string_arg(args, 0));
 }
 
 json templates::to_camel(Arguments &args) {
-  return str::to_camel(*args[0]);
+  return str::to_camel(string_arg(args, 0));
 }
 
 json templates::to_capital(Arguments &args) {
-  return str::to_capital(*args[0]);
+  return str::to_capital(string_arg(args, 0));
 }
 
 json templates::to_cobol(Arguments &args) {
-  return str::to_cobol(*args[0]);
+  return str::to_cobol(string_arg(args, 0));
 }
 
 json templates::to_const(Arguments &args) {
-  return str::to_const(*args[0]);
+  return str::to_const(string_arg(args, 0));
 }
 
 json templates::to_cpp(Arguments &args) {
-  return str::to_cpp(*args[0]);
+  return str::to_cpp(string_arg(args, 0));
 }
 
 json templates::to_dot(Arguments &args) {
-  return str::to_dot(*args[0]);
+  return str::to_dot(string_arg(args, 0));
 }
 
 json templates::to_kebab(Arguments &args) {
-  return str::to_kebab(*args[0]);
+  return str::to_kebab(string_arg(args, 0));
 }
 
 json templates::to_lower(Arguments &args) {
-  return str::to_lower(*args[0]);
+  return str::to_lower(string_arg(args, 0));
 }
 
 json templates::to_lower_first(Arguments &args) {
-  return str::to_lower_first(*args[0]);
+  return str::to_lower_first(string_arg(args, 0));
 }
 
 json templates::to_pascal(Arguments &args) {
-  return str::to_pascal(*args[0]);
+  return str::to_pascal(string_arg(args, 0));
 }
 
 json templates::to_path(Arguments &args) {
-  return str::to_path(*args[0]);
+  return str::to_path(string_arg(args, 0));
 }
 
 json templates::to_snake(Arguments &args) {
-  return str::to_snake(*args[0]);
+  return str::to_snake(string_arg(args, 0));
 }
 
 json templates::to_space(Arguments &args) {
-  return str::to_space(*args[0]);
+  return str::to_space(string_arg(args, 0));
 }
 
 json templates::to_train(Arguments &args) {
-  return str::to_train(*args[0]);
+  return str::to_train(string_arg(args, 0));
 }
 
 json templates::to_upper(Arguments &args) {
-  return str::to_upper(*args[0]);
+  return str::to_upper(string_arg(args, 0));
 }
 
 json templates::to_upper_first(Arguments &args) {
-  return str::to_upper_first(*args[0]);
+  return str::to_upper_first(string_arg(args, 0));
 }
 
 json templates::replace(Arguments &args) {
-  return str::replace_all(*args[0], *args[1], *args[2]);
+  return str::replace_all(string_arg(args, 0), string_arg(args, 1), string_arg(args, 2));
 }
 
 json templates::padleft(Arguments &args) {
-  return str::padleft(*args[0], *args[1], *args[2]);
+  return str::padleft(string_arg(args, 0), *args[1], string_arg(args, 2));
 }
 
 json templates::padright(Arguments &args) {
-  return str::padright(*args[0], *args[1], *args[2]);
+  return str::padright(string_arg(args, 0), *args[1], string_arg(args, 2));
 }
 
 json templates::sort_by(Arguments &args) {
   auto list = *args[1];
-  auto prop = "/" + str::replace_all(*args[0], "\\.", "/");
+  auto prop = "/" + str::replace_all(string_arg(args, 0), "\\.", "/");
   auto sorted = json::array();
 
   auto prop_ptr = json::json_pointer(prop);
@@ -400,3 +409,36 @@ Environment templates::engine() {
   auto env = Environment();
   return engine(env);
 }
+
+string templates::render(const string &source, const json &data) {
+  // bounded so scripts rendering generated sources don't grow it forever
+  constexpr size_t max_cached_templates = 256;
+
+  static auto env = engine();
+  static auto lock = mutex{};
+  static auto parsed = unordered_map<string, shared_ptr<const Template>>{};
+
+  auto current = shared_ptr<const Template>{};
+  {
+    auto guard = lock_guard(lock);
+    auto found = parsed.find(source);
+    if (found != parsed.end()) {
+      stats::add(stats::counter::template_cache_hits);
+      current = found->second;
+    } else {
+      if (parsed.size() >= max_cached_templates) {
+        parsed.clear();
+      }
+      auto traced = trace::span("template", "parse");
+      traced.arg("bytes", static_cast<int64_t>(source.size()));
+      current = make_shared<const Template>(env.parse(source));
+      parsed.emplace(source, current);
+      stats::add(stats::counter::templates_parsed);
+    }
+  }
+
+  auto traced = trace::span("template", "render");
+  auto result = env.render(*current, data);
+  traced.arg("bytes", static_cast<int64_t>(result.size()));
+  return result;
+}
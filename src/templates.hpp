@@ -43,4 +43,8 @@ namespace templates {
   inja::Environment engine(std::filesystem::path template_dir);
   inja::Environment engine();
 
+  // Renders `source` with a shared engine, reusing the parsed template when
+  // the same source is rendered again (also across watch mode runs).
+  std::string render(const std::string &source, const nlohmann::json &data);
+
 } // namespace templates
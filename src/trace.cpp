@@ -0,0 +1,141 @@
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <nlohmann/json.hpp>
+
+#include "./trace.hpp"
+
+using namespace std;
+using namespace nlohmann;
+
+namespace {
+
+  struct event {
+    string category;
+    string name;
+    trace::clock::time_point start;
+    trace::clock::time_point end;
+    size_t thread;
+    vector<trace::argument> arguments;
+  };
+
+  struct recorder {
+    atomic<bool> enabled = false;
+    trace::clock::time_point origin;
+
+    mutex lock;
+    vector<event> events;
+    unordered_map<thread::id, size_t> threads;
+  };
+
+  recorder &current() {
+    static recorder r;
+    return r;
+  }
+
+  double microseconds(trace::clock::duration elapsed) {
+    return chrono::duration<double, micro>(elapsed).count();
+  }
+
+} // namespace
+
+void trace::start() {
+  auto &r = current();
+  auto lock = lock_guard(r.lock);
+  if (!r.enabled) {
+    r.origin = clock::now();
+    r.enabled = true;
+  }
+}
+
+bool trace::enabled() {
+  return current().enabled.load(memory_order_relaxed);
+}
+
+void trace::complete(string_view category, string_view name, clock::time_point start, vector<argument> arguments) {
+  auto &r = current();
+  if (!r.enabled.load(memory_order_relaxed)) {
+    return;
+  }
+
+  auto end = clock::now();
+  auto lock = lock_guard(r.lock);
+  // small, stable thread numbers read better than native ids
+  auto [found, added] = r.threads.try_emplace(this_thread::get_id(), r.threads.size() + 1);
+  r.events.push_back(event{
+    .category = string(category),
+    .name = string(name),
+    .start = start,
+    .end = end,
+    .thread = found->second,
+    .arguments = move(arguments),
+  });
+}
+
+bool trace::write(const filesystem::path &file) {
+  auto &r = current();
+  auto events = json::array();
+  {
+    auto lock = lock_guard(r.lock);
+    events.push_back({ { "ph", "M" }, { "pid", 1 }, { "name", "process_name" }, { "args", { { "name", "flatt" } } } });
+    for (auto &e : r.events) {
+      auto args = json::object();
+      for (auto &[key, value] : e.arguments) {
+        visit(
+          [&](const auto &v) {
+            args[key] = v;
+          },
+          value);
+      }
+      events.push_back({
+        { "ph", "X" },
+        { "pid", 1 },
+        { "tid", e.thread },
+        { "cat", e.category },
+        { "name", e.name },
+        { "ts", microseconds(e.start - r.origin) },
+        { "dur", microseconds(e.end - e.start) },
+        { "args", move(args) },
+      });
+    }
+  }
+
+  // span arguments may hold file names that aren't valid UTF-8
+  auto document = json{ { "traceEvents", move(events) }, { "displayTimeUnit", "ms" } };
+  ofstream ofs(file, ios::binary | ios::trunc);
+  ofs << document.dump(-1, ' ', false, json::error_handler_t::replace);
+  ofs.flush();
+  return ofs.good();
+}
+
+trace::span::span(string_view category, string_view name)
+  : _active(enabled()) {
+  if (_active) {
+    _category = category;
+    _name = name;
+    _start = clock::now();
+  }
+}
+
+trace::span::~span() {
+  if (_active) {
+    complete(_category, _name, _start, move(_arguments));
+  }
+}
+
+trace::span &trace::span::arg(string_view key, string_view value) {
+  if (_active) {
+    _arguments.emplace_back(string(key), string(value));
+  }
+  return *this;
+}
+
+trace::span &trace::span::arg(string_view key, int64_t value) {
+  if (_active) {
+    _arguments.emplace_back(string(key), value);
+  }
+  return *this;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace trace {
+
+  using clock = std::chrono::steady_clock;
+  using argument = std::pair<std::string, std::variant<std::string, int64_t>>;
+
+  // Starts recording spans; until then (and by default) spans cost a check.
+  void start();
+  bool enabled();
+
+  // Records a span that started at `start` and ends now, on this thread.
+  void complete(std::string_view category, std::string_view name, clock::time_point start,
+                std::vector<argument> arguments = {});
+
+  // Writes what was recorded so far as Chrome trace events, for
+  // chrome://tracing, Perfetto or speedscope.
+  bool write(const std::filesystem::path &file);
+
+  // Times its own lifetime as a span when tracing is on.
+  class span {
+  public:
+    span(std::string_view category, std::string_view name);
+    span(const span &) = delete;
+    ~span();
+
+    span &operator=(const span &) = delete;
+
+    // Shown with the span in the viewer, e.g. the file and byte count.
+    span &arg(std::string_view key, std::string_view value);
+    span &arg(std::string_view key, int64_t value);
+
+  private:
+    bool _active;
+    clock::time_point _start;
+    std::string _category;
+    std::string _name;
+    std::vector<argument> _arguments;
+  };
+
+} // namespace trace
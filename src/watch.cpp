@@ -0,0 +1,147 @@
+#ifdef __linux__
+  #include <poll.h>
+  #include <sys/inotify.h>
+  #include <unistd.h>
+#endif
+
+#include <filesystem>
+#include <optional>
+#include <set>
+#include <thread>
+#include <unordered_map>
+
+#include <spdlog/spdlog.h>
+
+#include "./hash_cache.hpp"
+#include "./watch.hpp"
+
+using namespace std;
+using namespace std::filesystem;
+
+namespace {
+
+#ifdef __linux__
+
+  // Files that changed since `seen` was taken.
+  set<string> stale(const vector<string> &files, const vector<optional<hash_cache::file_stat>> &seen) {
+    auto changed = set<string>{};
+    for (size_t i = 0; i < files.size() && i < seen.size(); i++) {
+      if (hash_cache::stat(files[i]) != seen[i]) {
+        changed.insert(files[i]);
+      }
+    }
+    return changed;
+  }
+
+  // Watches the parent directories rather than the files themselves: editors
+  // and our own atomic writes replace files, which would orphan a file watch.
+  optional<vector<string>> wait_inotify(
+    const vector<string> &files, const vector<optional<hash_cache::file_stat>> &seen, chrono::milliseconds settle) {
+    auto fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd < 0) {
+      return {};
+    }
+
+    auto watched = set<string>(files.begin(), files.end());
+    auto directories = unordered_map<int, string>{};
+    for (auto &file : files) {
+      auto dir = path(file).parent_path().string();
+      auto wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE);
+      if (wd < 0) {
+        spdlog::debug("Unable to watch {}", dir);
+        continue;
+      }
+      directories[wd] = dir;
+    }
+
+    if (directories.empty()) {
+      close(fd);
+      return {};
+    }
+
+    // checked once the watches are armed, so nothing slips in between
+    auto changed = stale(files, seen);
+    alignas(inotify_event) char buffer[64 * 1024];
+
+    while (true) {
+      // wait forever for the first change, then only until things settle
+      auto pfd = pollfd{ .fd = fd, .events = POLLIN, .revents = 0 };
+      auto ready = poll(&pfd, 1, changed.empty() ? -1 : static_cast<int>(settle.count()));
+      if (ready < 0 && errno == EINTR) {
+        continue;
+      }
+      if (ready <= 0) {
+        break;
+      }
+
+      auto length = read(fd, buffer, sizeof(buffer));
+      for (auto offset = ssize_t{ 0 }; offset < length;) {
+        auto event = reinterpret_cast<const inotify_event *>(buffer + offset);
+        offset += sizeof(inotify_event) + event->len;
+
+        auto dir = directories.find(event->wd);
+        if (dir == directories.end() || event->len == 0) {
+          continue;
+        }
+
+        auto name = (path(dir->second) / event->name).generic_string();
+        if (watched.count(name) > 0) {
+          changed.insert(move(name));
+        }
+      }
+    }
+
+    close(fd);
+    return vector<string>(changed.begin(), changed.end());
+  }
+
+#endif
+
+  vector<string> wait_polling(
+    const vector<string> &files, const vector<optional<hash_cache::file_stat>> &seen, chrono::milliseconds settle) {
+    constexpr auto interval = chrono::milliseconds(250);
+
+    auto snapshot = [&]() {
+      auto stats = vector<optional<hash_cache::file_stat>>{};
+      for (auto &file : files) {
+        stats.push_back(hash_cache::stat(file));
+      }
+      return stats;
+    };
+
+    auto before = seen.size() == files.size() ? seen : snapshot();
+    while (true) {
+      this_thread::sleep_for(interval);
+      auto after = snapshot();
+      if (after == before) {
+        continue;
+      }
+
+      // give the writer a chance to finish before reporting
+      this_thread::sleep_for(settle);
+      after = snapshot();
+
+      auto changed = vector<string>{};
+      for (size_t i = 0; i < files.size(); i++) {
+        if (after[i] != before[i]) {
+          changed.push_back(files[i]);
+        }
+      }
+      return changed;
+    }
+  }
+
+} // namespace
+
+vector<string> watch::wait(
+  const vector<string> &files, const vector<optional<hash_cache::file_stat>> &seen, chrono::milliseconds settle) {
+#ifdef __linux__
+  auto changed = wait_inotify(files, seen, settle);
+  if (changed.has_value()) {
+    return changed.value();
+  }
+  spdlog::debug("inotify unavailable, polling for changes");
+#endif
+
+  return wait_polling(files, seen, settle);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <chrono>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "./hash_cache.hpp"
+
+namespace watch {
+
+  // Blocks until any of `files` is written, replaced or removed and returns
+  // the ones that changed. Events are coalesced until `settle` passes
+  // without another one, so an editor saving several files triggers once.
+  // Files that no longer match what `seen` recorded for them (e.g. changed
+  // while the run that read them was going) count as changed right away.
+  std::vector<std::string> wait(
+    const std::vector<std::string> &files, const std::vector<std::optional<hash_cache::file_stat>> &seen = {},
+    std::chrono::milliseconds settle = std::chrono::milliseconds(100));
+
+} // namespace watch